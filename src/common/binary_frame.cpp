@@ -0,0 +1,44 @@
+#include "binary_frame.h"
+
+uint16_t crc16Ccitt(const uint8_t* data, uint16_t length)
+{
+    uint16_t crc = 0xFFFF;
+    while (length--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for (uint8_t bit = 0; bit < 8; ++bit)
+            crc = crc & 0x8000 ? (uint16_t)((crc << 1) ^ 0x1021) : (uint16_t)(crc << 1);
+    }
+    return crc;
+}
+
+void cobsEncodeInPlace(uint8_t* data, uint16_t length)
+{
+    // With fewer than 254 bytes every block fits one code, so each zero is
+    // simply replaced by the distance to the next zero or to the end.
+    uint16_t code = 0;
+    for (uint16_t index = 1; index <= length; ++index) {
+        if (data[index] == 0) {
+            data[code] = (uint8_t)(index - code);
+            code = index;
+        }
+    }
+    data[code] = (uint8_t)(length + 1 - code);
+}
+
+int16_t cobsDecodeInPlace(uint8_t* data, uint16_t length)
+{
+    uint16_t read = 0;
+    uint16_t write = 0;
+
+    while (read < length) {
+        uint8_t code = data[read++];
+        if (code == 0 || read + code - 1 > length) return -1;
+
+        for (uint8_t index = 1; index < code; ++index) {
+            if (data[read] == 0) return -1;
+            data[write++] = data[read++];
+        }
+        if (code != 0xFF && read < length) data[write++] = 0;
+    }
+    return (int16_t)write;
+}
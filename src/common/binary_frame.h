@@ -0,0 +1,69 @@
+#ifndef BINARY_FRAME_H
+#define BINARY_FRAME_H
+
+#include <stdint.h>
+
+// Helpers for the binary protocol mode. A frame on the wire is the COBS
+// encoding of [type, fields..., crc16 low, crc16 high] followed by a single
+// 0x00 delimiter. Fields are little-endian; the CRC is CRC-16/CCITT-FALSE
+// over type and fields.
+enum BinaryFrameType : uint8_t {
+    BIN_SETPOINT = 0x01,
+    BIN_STATE_REQUEST = 0x02,
+    BIN_INFO_REQUEST = 0x03,
+    BIN_ASCII_MODE = 0x04,
+    BIN_ENQUEUE = 0x05,
+    BIN_FLUSH = 0x06,
+    BIN_QUEUE_REQUEST = 0x07,
+    BIN_COORDINATED = 0x08,
+    BIN_JERK = 0x09,
+    BIN_SUBSCRIBE = 0x0A,
+    BIN_MOTOR_CONFIG = 0x0B,
+    BIN_DIAGNOSTICS_REQUEST = 0x0C,
+    BIN_ADDRESSED = 0x0D,
+    BIN_COALESCING = 0x0E,
+    BIN_HALT = 0x0F,
+    BIN_EMERGENCY_DECEL = 0x10,
+    BIN_EMERGENCY_STOP = 0x11,
+    BIN_POSITION = 0x81,
+    BIN_STATE = 0x82,
+    BIN_INFO = 0x83,
+    BIN_QUEUE = 0x84,
+    BIN_JERK_STATE = 0x85,
+    BIN_SUBSCRIPTION = 0x86,
+    BIN_MOTOR_STATE = 0x87,
+    BIN_DIAGNOSTICS = 0x88,
+    BIN_DIAGNOSTICS_SOURCE = 0x89,
+    BIN_COALESCING_STATE = 0x8A,
+    BIN_HALT_STATE = 0x8B,
+    BIN_EMERGENCY_DECEL_STATE = 0x8C,
+    BIN_ERROR = 0xEE,
+};
+
+// The emergency stop frame as it is on the wire without its delimiter: the
+// COBS encoding of [BIN_EMERGENCY_STOP, crc16 low, crc16 high].
+constexpr uint8_t BINARY_STOP_FRAME[] = { 0x04, BIN_EMERGENCY_STOP, 0xE0, 0xE3 };
+constexpr uint8_t BINARY_STOP_FRAME_LENGTH = sizeof(BINARY_STOP_FRAME);
+
+uint16_t crc16Ccitt(const uint8_t* data, uint16_t length);
+
+// Encodes length bytes starting at data[1] in place, writing the leading
+// code byte to data[0]. The payload must be shorter than 254 bytes.
+void cobsEncodeInPlace(uint8_t* data, uint16_t length);
+
+// Decodes a frame without its delimiter in place and returns the decoded
+// length, or -1 when the encoding is invalid.
+int16_t cobsDecodeInPlace(uint8_t* data, uint16_t length);
+
+inline uint16_t readUint16Le(const uint8_t* data)
+{
+    return (uint16_t)(data[0] | ((uint16_t)data[1] << 8));
+}
+
+inline int32_t readInt32Le(const uint8_t* data)
+{
+    return (int32_t)((uint32_t)data[0] | ((uint32_t)data[1] << 8) |
+                     ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 24));
+}
+
+#endif
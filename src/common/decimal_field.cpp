@@ -0,0 +1,90 @@
+#include "decimal_field.h"
+
+#include <ctype.h>
+
+namespace {
+constexpr uint32_t maxMagnitude = 2000000000UL;
+
+bool isDigit(char value)
+{
+    return value >= '0' && value <= '9';
+}
+
+bool accumulate(uint32_t& magnitude, uint8_t digit)
+{
+    if (magnitude > (maxMagnitude - digit) / 10) return false;
+    magnitude = magnitude * 10 + digit;
+    return true;
+}
+
+bool parseField(const char*& cursor, const char* end, uint8_t decimals,
+                int32_t& value)
+{
+    const char* position = cursor;
+    while (position < end && isspace((unsigned char)*position)) ++position;
+
+    bool negative = false;
+    if (position < end && (*position == '+' || *position == '-')) {
+        negative = *position == '-';
+        ++position;
+    }
+
+    uint32_t magnitude = 0;
+    uint8_t digits = 0;
+    bool valid = true;
+    while (position < end && isDigit(*position)) {
+        valid = valid && accumulate(magnitude, (uint8_t)(*position - '0'));
+        ++position;
+        ++digits;
+    }
+
+    uint8_t fractionDigits = 0;
+    bool roundUp = false;
+    if (decimals > 0 && position < end && *position == '.') {
+        ++position;
+        while (position < end && isDigit(*position)) {
+            if (fractionDigits < decimals) {
+                valid = valid && accumulate(magnitude, (uint8_t)(*position - '0'));
+                ++fractionDigits;
+            } else if (fractionDigits == decimals) {
+                roundUp = *position >= '5';
+                ++fractionDigits;
+            }
+            ++position;
+            ++digits;
+        }
+        if (fractionDigits > decimals) fractionDigits = decimals;
+    }
+
+    while (fractionDigits++ < decimals) valid = valid && accumulate(magnitude, 0);
+    if (roundUp) {
+        if (magnitude >= maxMagnitude) valid = false;
+        else ++magnitude;
+    }
+
+    while (position < end && isspace((unsigned char)*position)) ++position;
+    if (digits == 0 || (position < end && *position != ',')) valid = false;
+
+    while (position < end && *position != ',') ++position;
+    cursor = position;
+
+    if (!valid) return false;
+    value = negative ? -(int32_t)magnitude : (int32_t)magnitude;
+    return true;
+}
+}
+
+bool parseMilliField(const char*& cursor, const char* end, int32_t& value)
+{
+    return parseField(cursor, end, 3, value);
+}
+
+bool parseIntegerField(const char*& cursor, const char* end,
+                       int32_t minimum, int32_t maximum, int32_t& value)
+{
+    int32_t parsed;
+    if (!parseField(cursor, end, 0, parsed)) return false;
+    if (parsed < minimum || parsed > maximum) return false;
+    value = parsed;
+    return true;
+}
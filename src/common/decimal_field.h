@@ -0,0 +1,21 @@
+#ifndef DECIMAL_FIELD_H
+#define DECIMAL_FIELD_H
+
+#include <stdint.h>
+
+// Single-pass parsing of comma separated command fields without strtod.
+// Each call reads the field starting at cursor and leaves cursor on the
+// following ',' or on end, whether the field was valid or not. Blanks
+// around the number are allowed; exponents, nan and inf are not.
+
+// Fixed-point field in thousandths, e.g. "-12.5" gives -12500. Further
+// decimals are rounded. Magnitudes above 2000000 are rejected.
+bool parseMilliField(const char*& cursor, const char* end, int32_t& value);
+
+// Integer field within [minimum, maximum].
+bool parseIntegerField(const char*& cursor, const char* end,
+                       int32_t minimum, int32_t maximum, int32_t& value);
+
+#define DECIMAL_FIELD_SCALE 1000L
+
+#endif
@@ -0,0 +1,121 @@
+#include "frame_builder.h"
+#include "binary_frame.h"
+
+namespace {
+// Room kept at the end of the buffer for the line terminator, or for the
+// CRC and delimiter of a binary frame.
+constexpr uint16_t terminatorLength = 3;
+}
+
+void FrameBuilder::begin(const char* prefix)
+{
+    _length = 0;
+    _sent = 0;
+    appendText(prefix);
+}
+
+void FrameBuilder::appendText(const char* text)
+{
+    while (*text) appendChar(*text++);
+}
+
+void FrameBuilder::appendChar(char value)
+{
+    if (_length + terminatorLength < BUFFER_SIZE) _buffer[_length++] = value;
+}
+
+void FrameBuilder::appendInteger(long value)
+{
+    unsigned long magnitude = value < 0 ? 0UL - (unsigned long)value
+                                        : (unsigned long)value;
+    if (value < 0) appendChar('-');
+
+    char digits[10];
+    uint8_t count = 0;
+    do {
+        digits[count++] = (char)('0' + magnitude % 10);
+        magnitude /= 10;
+    } while (magnitude > 0);
+
+    while (count > 0) appendChar(digits[--count]);
+}
+
+void FrameBuilder::appendCentis(long centis)
+{
+    unsigned long magnitude = centis < 0 ? 0UL - (unsigned long)centis
+                                         : (unsigned long)centis;
+    if (centis < 0) appendChar('-');
+
+    appendInteger((long)(magnitude / 100));
+    uint8_t fraction = (uint8_t)(magnitude % 100);
+    appendChar('.');
+    appendChar((char)('0' + fraction / 10));
+    appendChar((char)('0' + fraction % 10));
+}
+
+void FrameBuilder::end()
+{
+    _buffer[_length++] = '\r';
+    _buffer[_length++] = '\n';
+}
+
+void FrameBuilder::beginBinary(uint8_t type)
+{
+    // _buffer[0] is left for the COBS code byte.
+    _length = 1;
+    _sent = 0;
+    appendUint8(type);
+}
+
+void FrameBuilder::appendUint8(uint8_t value)
+{
+    appendChar((char)value);
+}
+
+void FrameBuilder::appendUint16(uint16_t value)
+{
+    appendUint8((uint8_t)value);
+    appendUint8((uint8_t)(value >> 8));
+}
+
+void FrameBuilder::appendInt32(int32_t value)
+{
+    uint32_t bits = (uint32_t)value;
+    for (uint8_t index = 0; index < 4; ++index) {
+        appendUint8((uint8_t)bits);
+        bits >>= 8;
+    }
+}
+
+void FrameBuilder::endBinary()
+{
+    uint16_t crc = crc16Ccitt((const uint8_t*)_buffer + 1, _length - 1);
+    _buffer[_length++] = (char)(crc & 0xFF);
+    _buffer[_length++] = (char)(crc >> 8);
+    cobsEncodeInPlace((uint8_t*)_buffer, _length - 1);
+    _buffer[_length++] = 0;
+}
+
+bool FrameBuilder::flush(Print& out)
+{
+    if (idle()) return true;
+
+    int room = out.availableForWrite();
+    if (room <= 0) return false;
+
+    uint16_t pending = _length - _sent;
+    uint16_t chunk = (uint16_t)room < pending ? (uint16_t)room : pending;
+    _sent += out.write((const uint8_t*)_buffer + _sent, chunk);
+    return idle();
+}
+
+long scaleDegrees(double degrees, uint16_t scale)
+{
+    double scaled = degrees * scale;
+    return (long)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+}
+
+long toCentidegrees(double steps, double degreesPerStep)
+{
+    return scaleDegrees(steps * degreesPerStep, 100);
+}
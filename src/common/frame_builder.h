@@ -0,0 +1,44 @@
+#ifndef FRAME_BUILDER_H
+#define FRAME_BUILDER_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Formats one outgoing text frame into a fixed buffer without floating
+// point, then hands it to the port in pieces. flush() writes no more than
+// availableForWrite() reports, so it never waits on a full TX buffer; the
+// caller keeps calling it until idle() before starting the next frame.
+// beginBinary()/endBinary() build a COBS frame of the binary mode instead.
+class FrameBuilder
+{
+    public:
+        static constexpr uint16_t BUFFER_SIZE = 192;
+
+        void begin(const char* prefix);
+        void appendText(const char* text);
+        void appendChar(char value);
+        void appendInteger(long value);
+        void appendCentis(long centis);
+        void end();
+
+        void beginBinary(uint8_t type);
+        void appendUint8(uint8_t value);
+        void appendUint16(uint16_t value);
+        void appendInt16(int16_t value) { appendUint16((uint16_t)value); }
+        void appendInt32(int32_t value);
+        void endBinary();
+
+        bool flush(Print& out);
+        bool idle() const { return _sent == _length; }
+
+    private:
+        char _buffer[BUFFER_SIZE];
+        uint16_t _length = 0;
+        uint16_t _sent = 0;
+};
+
+// Rounds degrees to 1/scale of a degree, and steps to hundredths of one.
+long scaleDegrees(double degrees, uint16_t scale);
+long toCentidegrees(double steps, double degreesPerStep);
+
+#endif
@@ -0,0 +1,39 @@
+#include "isr_diagnostics.h"
+
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+double diagnosticsCountsPerUs()
+{
+#if defined(ARDUINO_ARCH_ESP32)
+    return getCpuFrequencyMhz();
+#elif defined(ARDUINO_ARCH_AVR)
+    // Timer1 of avr_2m runs at 250 kHz.
+    return 0.25;
+#else
+    return 1.0;
+#endif
+}
+
+void IsrProbe::setPeriod(double seconds)
+{
+    uint32_t period = (uint32_t)(seconds * 1e6 * diagnosticsCountsPerUs() + 0.5);
+    noInterrupts();
+    _period = period;
+    interrupts();
+}
+
+void IsrProbe::calibrate()
+{
+    uint32_t countsPerUsQ8 = (uint32_t)(diagnosticsCountsPerUs() * 256.0 + 0.5);
+    noInterrupts();
+    _countsPerUsQ8 = countsPerUsQ8;
+    interrupts();
+}
+
+void IsrProbe::takeStats(IsrTimingStats& stats)
+{
+    noInterrupts();
+    stats = _stats;
+    _stats = IsrTimingStats();
+    interrupts();
+}
+#endif
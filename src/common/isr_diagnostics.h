@@ -0,0 +1,101 @@
+#ifndef ISR_DIAGNOSTICS_H
+#define ISR_DIAGNOSTICS_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Define STEPPER_ISR_DIAGNOSTICS to time the motor kernels and the timer
+// interrupts. Otherwise the ISR_PROBE_ macros expand to nothing and no
+// probe exists.
+//
+// Times are read from a free-running counter: the CPU cycle counter on
+// ESP32, TCNT1 on AVR (4 us per count with the 250 kHz Timer1 of avr_2m)
+// and the virtual microseconds of the native shim.
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <esp_cpu.h>
+typedef uint32_t DiagnosticsCount;
+inline DiagnosticsCount diagnosticsCounter()
+{
+    return (DiagnosticsCount)esp_cpu_get_cycle_count();
+}
+#elif defined(ARDUINO_ARCH_AVR)
+typedef uint16_t DiagnosticsCount;
+inline DiagnosticsCount diagnosticsCounter() { return TCNT1; }
+#else
+typedef uint32_t DiagnosticsCount;
+inline DiagnosticsCount diagnosticsCounter() { return (DiagnosticsCount)micros(); }
+#endif
+
+double diagnosticsCountsPerUs();
+
+struct IsrTimingStats
+{
+    uint32_t calls;
+    uint32_t minTime;
+    uint32_t maxTime;
+    uint64_t totalTime;
+    uint32_t maxJitter;
+    uint32_t overruns;
+};
+
+// Timing of one interrupt handler in counter units, inlined into it.
+// Jitter is how far the interval between two entries strays from the
+// expected period. An overrun is an entry more than half a period late or
+// a run longer than the period.
+class IsrProbe
+{
+    public:
+        // Expected interval between entries: setPeriod() from the main
+        // loop, or setPeriodUs() from the interrupt (or with it masked)
+        // once calibrate() has run.
+        void setPeriod(double seconds);
+        void calibrate();
+        void setPeriodUs(uint32_t us) { _period = (us * _countsPerUsQ8) >> 8; }
+
+        void begin()
+        {
+            DiagnosticsCount now = diagnosticsCounter();
+            if (_started && _period) {
+                uint32_t interval = (DiagnosticsCount)(now - _start);
+                uint32_t jitter = interval > _period ? interval - _period
+                                                     : _period - interval;
+                if (jitter > _stats.maxJitter) _stats.maxJitter = jitter;
+                if (interval > _period + _period / 2) ++_stats.overruns;
+            }
+            _started = true;
+            _start = now;
+        }
+
+        void end()
+        {
+            uint32_t elapsed = (DiagnosticsCount)(diagnosticsCounter() - _start);
+            if (_stats.calls == 0 || elapsed < _stats.minTime) _stats.minTime = elapsed;
+            if (elapsed > _stats.maxTime) _stats.maxTime = elapsed;
+            _stats.totalTime += elapsed;
+            ++_stats.calls;
+            if (_period && elapsed > _period) ++_stats.overruns;
+        }
+
+        // Copies the statistics and starts over; called from the main loop.
+        void takeStats(IsrTimingStats& stats);
+
+    private:
+        IsrTimingStats _stats = {};
+        DiagnosticsCount _start = 0;
+        bool _started = false;
+        uint32_t _period = 0;
+        uint32_t _countsPerUsQ8 = 0;
+};
+
+#define ISR_PROBE_BEGIN(probe) (probe).begin()
+#define ISR_PROBE_END(probe) (probe).end()
+#define ISR_PROBE_PERIOD_US(probe, us) (probe).setPeriodUs(us)
+#else
+#define ISR_PROBE_BEGIN(probe)
+#define ISR_PROBE_END(probe)
+#define ISR_PROBE_PERIOD_US(probe, us)
+#endif
+
+#endif
@@ -0,0 +1,135 @@
+#include "line_assembler.h"
+#include "binary_frame.h"
+
+LineAssembler::LineAssembler(uint16_t maxLineLength)
+    : _maxLineLength(maxLineLength < RING_SIZE ? maxLineLength : RING_SIZE - 1)
+{
+}
+
+void LineAssembler::feed(Stream& stream)
+{
+    while (_count < RING_SIZE && stream.available() > 0) {
+        int value = stream.read();
+        if (value < 0) break;
+        push((uint8_t)value);
+    }
+}
+
+void LineAssembler::push(uint8_t value)
+{
+    if (_terminator == '\n' && value == STOP_BYTE) {
+        requestStop();
+        return;
+    }
+
+    if (_discarding) {
+        if (value == _terminator) {
+            _discarding = false;
+            if (!_discardingStopped && _overflows < 255) ++_overflows;
+            _discardingStopped = false;
+        }
+        return;
+    }
+
+    if (_terminator != '\n' && value == _terminator) {
+        if (_partialLength == 0) return;
+        if (partialIsStopFrame()) {
+            _partialLength = 0;
+            requestStop();
+            return;
+        }
+    }
+
+    if (value != _terminator && _partialLength >= _maxLineLength) {
+        _head = (_head - _partialLength) & RING_MASK;
+        _count -= _partialLength;
+        _partialLength = 0;
+        _discarding = true;
+        return;
+    }
+
+    _ring[_head] = value;
+    _head = (_head + 1) & RING_MASK;
+    ++_count;
+
+    if (value == _terminator) {
+        ++_completeLines;
+        _partialLength = 0;
+    } else {
+        ++_partialLength;
+    }
+}
+
+bool LineAssembler::partialIsStopFrame() const
+{
+    if (_partialLength != BINARY_STOP_FRAME_LENGTH) return false;
+
+    uint16_t start = (_head - _partialLength) & RING_MASK;
+    for (uint8_t offset = 0; offset < BINARY_STOP_FRAME_LENGTH; ++offset) {
+        if (_ring[(start + offset) & RING_MASK] != BINARY_STOP_FRAME[offset])
+            return false;
+    }
+    return true;
+}
+
+int16_t LineAssembler::nextLine(char* line, uint16_t capacity)
+{
+    if (_completeLines == 0 || capacity == 0) return -1;
+
+    uint16_t length = 0;
+    for (;;) {
+        uint8_t value = _ring[_tail];
+        _tail = (_tail + 1) & RING_MASK;
+        --_count;
+        if (value == _terminator) break;
+        if (length + 1 < capacity) line[length++] = (char)value;
+    }
+    --_completeLines;
+
+    if (_terminator == '\n' && length > 0 && line[length - 1] == '\r') --length;
+    line[length] = '\0';
+    return length;
+}
+
+void LineAssembler::requestStop()
+{
+    bool cutLine = _partialLength > 0 || _discarding;
+    _head = 0;
+    _tail = 0;
+    _count = 0;
+    _completeLines = 0;
+    _partialLength = 0;
+    _discardingStopped = cutLine;
+    _discarding = cutLine;
+    _stopRequested = true;
+}
+
+bool LineAssembler::takeStop()
+{
+    if (!_stopRequested) return false;
+    _stopRequested = false;
+    return true;
+}
+
+bool LineAssembler::takeOverflow()
+{
+    if (_overflows == 0) return false;
+    --_overflows;
+    return true;
+}
+
+void LineAssembler::setTerminator(uint8_t terminator)
+{
+    // Bytes already buffered are split again with the new terminator.
+    _terminator = terminator;
+    _completeLines = 0;
+    _partialLength = 0;
+    for (uint16_t offset = 0; offset < _count; ++offset) {
+        if (_ring[(_tail + offset) & RING_MASK] == terminator) {
+            ++_completeLines;
+            _partialLength = 0;
+        } else {
+            ++_partialLength;
+        }
+    }
+}
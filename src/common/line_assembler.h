@@ -0,0 +1,58 @@
+#ifndef LINE_ASSEMBLER_H
+#define LINE_ASSEMBLER_H
+
+#include <Arduino.h>
+#include <stdint.h>
+
+// Incremental line reader for the serial protocol. Lines end with '\n' by
+// default; the binary mode switches the terminator to the COBS delimiter.
+//
+// feed() copies only the bytes the stream already holds into a ring buffer
+// and never waits for the rest of a line. Complete lines are then taken out
+// one by one with nextLine(). A line longer than maxLineLength is dropped up
+// to its terminator and counted as an overflow. When the ring is full the
+// remaining bytes stay in the stream until lines have been taken out.
+//
+// A stop request is recognised as it arrives, without waiting for a line:
+// STOP_BYTE in ASCII mode, the delimiter of a BINARY_STOP_FRAME in binary
+// mode. Everything buffered is dropped with it, and the rest of an
+// interrupted ASCII line up to its terminator. Empty binary frames, such as
+// a delimiter sent ahead of a frame to resynchronise, are skipped.
+class LineAssembler
+{
+    public:
+        static constexpr uint16_t RING_SIZE = 256;
+        static constexpr uint8_t STOP_BYTE = 0x18;
+
+        explicit LineAssembler(uint16_t maxLineLength);
+
+        void feed(Stream& stream);
+        int16_t nextLine(char* line, uint16_t capacity);
+        bool hasLine() const { return _completeLines > 0; }
+        bool takeOverflow();
+        bool takeStop();
+        void setTerminator(uint8_t terminator);
+
+    private:
+        void push(uint8_t value);
+        bool partialIsStopFrame() const;
+        void requestStop();
+
+        static constexpr uint16_t RING_MASK = RING_SIZE - 1;
+
+        uint8_t _ring[RING_SIZE];
+        uint16_t _head = 0;
+        uint16_t _tail = 0;
+        uint16_t _count = 0;
+        uint16_t _partialLength = 0;
+        uint16_t _maxLineLength;
+        uint8_t _terminator = '\n';
+        uint16_t _completeLines = 0;
+        uint8_t _overflows = 0;
+        bool _discarding = false;
+        // Discarding the tail of a line cut by a stop, not an overflow.
+        bool _discardingStopped = false;
+        bool _stopRequested = false;
+};
+
+#endif
@@ -1,19 +1,123 @@
 #include "moving_speaker_protocol.h"
-
-#include <ctype.h>
-#include <errno.h>
-#include <math.h>
-#include <stdlib.h>
-#include <string.h>
+#include "binary_frame.h"
+#include "decimal_field.h"
 
 namespace {
-struct ParsedMotorCommand
+constexpr uint8_t maxMotorChannels = PROTOCOL_MAX_MOTORS;
+// Held motion lines after which the newest commands are applied anyway,
+// so that a host sending without pause cannot starve the motors.
+constexpr uint8_t maxCoalescedLines = 16;
+constexpr int32_t maxJerkDegrees = 10000000;
+constexpr int32_t maxEmergencyDecelDegrees = 10000000;
+constexpr int32_t maxStepsPerRev = 2000000;
+constexpr int32_t minTimerPeriodUs = 20;
+constexpr int32_t maxTimerPeriodUs = 20000;
+
+// Applies or queues one command per motor of the mask; the other motors
+// keep their targets. A queued command is only taken when every addressed
+// motor still has room for it. A coordinated command gives every addressed
+// motor of a group the duration of the slowest one.
+bool applyCommands(MotorChannel* motors, uint8_t motorCount, uint8_t mask,
+                   const ParsedMotorCommand* commands, CommandAction action)
+{
+    if (action == COMMAND_ENQUEUE) {
+        for (uint8_t index = 0; index < motorCount; ++index) {
+            if ((mask & (1U << index)) && !motors[index].stepper->canEnqueue())
+                return false;
+        }
+    }
+
+    double durations[maxMotorChannels];
+    if (action == COMMAND_COORDINATED) {
+        for (uint8_t index = 0; index < motorCount; ++index) {
+            durations[index] = 0.0;
+            if (!(mask & (1U << index))) continue;
+            const ParsedMotorCommand& command = commands[index];
+            durations[index] = motors[index].stepper->moveDurationDegrees(
+                command.target, command.speed, command.acceleration,
+                command.mode, motors[index].modulo);
+        }
+    }
+
+    for (uint8_t index = 0; index < motorCount; ++index) {
+        if (!(mask & (1U << index))) continue;
+        StepperCore& stepper = *motors[index].stepper;
+        const ParsedMotorCommand& command = commands[index];
+        bool modulo = motors[index].modulo;
+
+        if (action == COMMAND_ENQUEUE) {
+            stepper.enqueueCommandDegrees(command.target, command.speed,
+                                          command.acceleration, command.mode,
+                                          modulo);
+        } else if (action == COMMAND_COORDINATED) {
+            double duration = 0.0;
+            for (uint8_t other = 0; other < motorCount; ++other) {
+                if (motors[other].group == motors[index].group &&
+                    durations[other] > duration)
+                    duration = durations[other];
+            }
+            stepper.applyCoordinatedDegrees(command.target, command.speed,
+                                            command.acceleration, command.mode,
+                                            modulo, duration);
+        } else {
+            stepper.applyCommandDegrees(command.target, command.speed,
+                                        command.acceleration, command.mode,
+                                        modulo);
+        }
+    }
+    return true;
+}
+
+uint16_t toUnsigned16(long value)
+{
+    if (value < 0) return 0;
+    return value > 0xFFFF ? 0xFFFF : (uint16_t)value;
+}
+
+int16_t toSigned16(long value)
+{
+    if (value < -32768) return -32768;
+    return value > 32767 ? 32767 : (int16_t)value;
+}
+
+// One integer in [0, maximum] per motor, as ASCII fields or as int32
+// fields. Returns the error to report, or nullptr.
+const char* parseMotorIntegers(const char* fields, uint16_t length,
+                               uint8_t motorCount, int32_t maximum,
+                               int32_t* values)
 {
-    double target;
-    double speed;
-    double acceleration;
-    RotaryMode mode;
-};
+    const char* error = nullptr;
+    const char* cursor = fields;
+    const char* end = fields + length;
+    uint8_t motor = 0;
+
+    for (;;) {
+        if (motor >= motorCount) return "Invalid frame: wrong number of fields";
+        if (!parseIntegerField(cursor, end, 0, maximum, values[motor]) && !error)
+            error = "Invalid frame: invalid numeric field";
+        ++motor;
+
+        if (cursor >= end) break;
+        ++cursor;
+    }
+
+    if (motor != motorCount) return "Invalid frame: wrong number of fields";
+    return error;
+}
+
+const char* readMotorIntegers(const uint8_t* fields, uint16_t length,
+                              uint8_t motorCount, int32_t maximum,
+                              int32_t* values)
+{
+    if (length != motorCount * 4) return "Invalid frame: wrong number of fields";
+
+    for (uint8_t index = 0; index < motorCount; ++index) {
+        values[index] = readInt32Le(fields + index * 4);
+        if (values[index] < 0 || values[index] > maximum)
+            return "Invalid frame: invalid numeric field";
+    }
+    return nullptr;
+}
 }
 
 MovingSpeakerProtocol::MovingSpeakerProtocol(Stream& serial,
@@ -23,44 +127,215 @@ MovingSpeakerProtocol::MovingSpeakerProtocol(Stream& serial,
     : _serial(serial),
       _motors(motors),
       _motorCount(motorCount),
-    _infoTitle(infoTitle)
+      _infoTitle(infoTitle),
+      _telemetryMotors((uint8_t)((1U << motorCount) - 1)),
+      _assembler(sizeof(_buffer) - 1)
 {
 }
 
 void MovingSpeakerProtocol::process()
 {
-    if (millis() - _lastPositionFrame > 100) {
+    serviceMotion();
+
+    bool frameIdle = _frame.flush(_serial);
+
+    // Modulo motors are renormalized on the telemetry schedule, or every
+    // 100 ms when no P frames are subscribed.
+    unsigned long period = _telemetryPeriod ? _telemetryPeriod : 100;
+    if (frameIdle && millis() - _lastPositionFrame >= period) {
         _lastPositionFrame = millis();
-        sendPositionFrame();
+        if (_telemetryPeriod) sendPositionFrame();
+        renormalizeModuloMotors();
+        frameIdle = _frame.idle();
     }
 
-    if (_serial.available()) {
-        uint16_t length = _serial.readBytesUntil('\n', _buffer, sizeof(_buffer) - 1);
+    _assembler.feed(_serial);
 
-        if (length == sizeof(_buffer) - 1) {
-            _serial.find('\n');
-            _serial.println("E: Invalid frame: line too long");
-            return;
-        }
+    // A stop does not wait for a pending frame.
+    if (_assembler.takeStop()) emergencyStop();
 
-        _buffer[length] = '\0';
+    // A line may answer with a frame of its own, so it waits until the
+    // pending one has been handed to the port.
+    if (!frameIdle) return;
 
-        if (length == 1 && _buffer[0] == 'I') {
-            sendInfoFrame();
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+    if (_diagnosticsPending) {
+        sendDiagnosticsFrame();
+        return;
+    }
+#endif
+
+    if (_assembler.takeOverflow()) {
+        sendError("Invalid frame: line too long");
+        return;
+    }
+
+    // Held motion commands let the next line follow in the same call; the
+    // held ones are applied once the backlog is drained.
+    int16_t length = _assembler.nextLine(_buffer, sizeof(_buffer));
+    while (length >= 0) {
+        _assembler.feed(_serial);
+        if (_assembler.takeStop()) {
+            emergencyStop();
             return;
         }
+        _holdCommands = _coalescing && _assembler.hasLine();
+        uint8_t heldLines = _pendingLines;
+        processLine((uint16_t)length);
+        if (_pendingLines <= heldLines || !_frame.idle()) return;
+        length = _assembler.nextLine(_buffer, sizeof(_buffer));
+    }
+    applyPendingCommands();
+}
 
-        if (length == 1 && _buffer[0] == 'T') {
-            sendStateFrame();
-            return;
+void MovingSpeakerProtocol::serviceMotion()
+{
+    for (uint8_t index = 0; index < _motorCount; ++index)
+        _motors[index].stepper->serviceSegments();
+}
+
+int16_t MovingSpeakerProtocol::receiveLine(char* line, uint16_t capacity)
+{
+    pollInput();
+    // The error waits like a line would while a frame is still going out.
+    if (_frame.idle() && _assembler.takeOverflow())
+        sendError("Invalid frame: line too long");
+    return _assembler.nextLine(line, capacity);
+}
+
+void MovingSpeakerProtocol::pollInput()
+{
+    _assembler.feed(_serial);
+    if (_assembler.takeStop()) emergencyStop();
+}
+
+void MovingSpeakerProtocol::handleLine(const char* line, uint16_t length,
+                                       bool lineQueued)
+{
+    if (length >= sizeof(_buffer)) return;
+
+    memcpy(_buffer, line, length);
+    _buffer[length] = '\0';
+    _holdCommands = _coalescing && lineQueued;
+    processLine(length);
+    if (!lineQueued) applyPendingCommands();
+}
+
+void MovingSpeakerProtocol::sendTelemetry()
+{
+    if (_telemetryPeriod) sendPositionFrame();
+    renormalizeModuloMotors();
+}
+
+// Writes the pending frame, and the rest of a D report, as far as the port
+// takes them without waiting.
+bool MovingSpeakerProtocol::flushOutput()
+{
+    for (;;) {
+        if (!_frame.flush(_serial)) return false;
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+        if (_diagnosticsPending) {
+            sendDiagnosticsFrame();
+            continue;
         }
+#endif
+        return true;
+    }
+}
+
+void MovingSpeakerProtocol::processLine(uint16_t length)
+{
+    if (_binary) {
+        processBinaryFrame(length);
+        return;
+    }
+
+    // Any other line than a plain motion command sees the held ones applied.
+    if (_buffer[0] >= 'A' && _buffer[0] <= 'Z') applyPendingCommands();
 
-        processCommand(length);
+    if (length == 1 && _buffer[0] == 'B') {
+        _serial.println("I: Binary mode");
+        _binary = true;
+        _telemetrySent = false;
+        _assembler.setTerminator(0);
+        return;
+    }
+
+    if (length == 1 && _buffer[0] == 'I') {
+        sendInfoFrame();
+        return;
+    }
+
+    if (length == 1 && _buffer[0] == 'T') {
+        sendStateFrame();
+        return;
     }
+
+    if (_buffer[0] == 'Q') {
+        if (length == 1) sendQueueFrame();
+        else processCommand(_buffer + 1, length - 1, COMMAND_ENQUEUE);
+        return;
+    }
+
+    if (_buffer[0] == 'G') {
+        processCommand(_buffer + 1, length - 1, COMMAND_COORDINATED);
+        return;
+    }
+
+    if (length == 1 && _buffer[0] == 'F') {
+        flushQueues();
+        return;
+    }
+
+    if (_buffer[0] == 'U') {
+        if (length == 1) sendSubscriptionFrame();
+        else processSubscribe(_buffer + 1, length - 1);
+        return;
+    }
+
+    if (_buffer[0] == 'M') {
+        processMotorConfig(_buffer + 1, length - 1);
+        return;
+    }
+
+    if (_buffer[0] == 'J') {
+        if (length == 1) sendJerkFrame();
+        else processJerk(_buffer + 1, length - 1);
+        return;
+    }
+
+    if (_buffer[0] == 'H') {
+        processHalt(_buffer + 1, length - 1);
+        return;
+    }
+
+    if (_buffer[0] == 'K') {
+        if (length == 1) sendEmergencyDecelFrame();
+        else processEmergencyDecel(_buffer + 1, length - 1);
+        return;
+    }
+
+    if (length == 1 && _buffer[0] == 'D') {
+        startDiagnostics();
+        return;
+    }
+
+    if (_buffer[0] == 'C') {
+        if (length == 1) sendCoalescingFrame();
+        else processCoalescing(_buffer + 1, length - 1);
+        return;
+    }
+
+    processCommand(_buffer, length, COMMAND_APPLY);
 }
 
 void MovingSpeakerProtocol::sendInfoFrame()
 {
+    if (_binary) {
+        sendBinaryInfoFrame();
+        return;
+    }
+
     _serial.println(_infoTitle);
     _serial.print("I: ");
 
@@ -85,139 +360,1061 @@ void MovingSpeakerProtocol::sendInfoFrame()
     _serial.println("I: Ready");
 }
 
+// Only the subscribed motors and fields are written, in motor order and
+// with the fields of a motor in the order running, position, speed.
 void MovingSpeakerProtocol::sendPositionFrame()
 {
-    _serial.print("P: ");
+    if (_motorCount > maxMotorChannels) return;
+
+    TelemetrySample samples[maxMotorChannels];
+    if (!sampleTelemetry(samples) && _telemetryOnChange) return;
+
+    if (_binary) _frame.beginBinary(BIN_POSITION);
+    else _frame.begin("P: ");
+
+    bool first = true;
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        if (!(_telemetryMotors & (1U << index))) continue;
+        const TelemetrySample& sample = samples[index];
+
+        if (_binary) {
+            if (_telemetryFields & TELEMETRY_RUNNING) _frame.appendUint8(sample.running);
+            if (_telemetryFields & TELEMETRY_POSITION) _frame.appendInt32(sample.position);
+            if (_telemetryFields & TELEMETRY_SPEED) _frame.appendInt16((int16_t)sample.speed);
+            continue;
+        }
+
+        if (_telemetryFields & TELEMETRY_RUNNING) {
+            if (!first) _frame.appendChar(',');
+            _frame.appendInteger(sample.running);
+            first = false;
+        }
+        if (_telemetryFields & TELEMETRY_POSITION) {
+            if (!first) _frame.appendChar(',');
+            _frame.appendCentis(sample.position);
+            first = false;
+        }
+        if (_telemetryFields & TELEMETRY_SPEED) {
+            if (!first) _frame.appendChar(',');
+            _frame.appendCentis(sample.speed);
+            first = false;
+        }
+    }
+
+    if (_binary) _frame.endBinary();
+    else _frame.end();
+    _frame.flush(_serial);
+}
+
+// Reads the subscribed motors into samples and remembers them as sent.
+// Returns whether a subscribed field differs from the previous frame.
+bool MovingSpeakerProtocol::sampleTelemetry(TelemetrySample* samples)
+{
+    bool changed = !_telemetrySent;
 
     for (uint8_t index = 0; index < _motorCount; ++index) {
+        if (!(_telemetryMotors & (1U << index))) continue;
+
         StepperState state;
         _motors[index].stepper->readState(state);
-        _serial.print(state.running);
-        _serial.print(",");
-        if (_motors[index].modulo)
-            _serial.print((double)state.positionModulo * 360.0 / state.stepsPerRev);
+        TelemetrySample& sample = samples[index];
+        sample.running = state.running;
+        sample.position = toCentidegrees(_motors[index].modulo ? state.positionModulo
+                                                              : state.position,
+                                         state.degreesPerStep);
+        if (_binary)
+            sample.speed = toSigned16(
+                scaleDegrees(state.speed * state.degreesPerStep, 10));
         else
-            _serial.print((double)state.position * 360.0 / state.stepsPerRev);
-        _serial.print(",");
-        _serial.print(state.speed * 360.0 / state.stepsPerRev);
+            sample.speed = toCentidegrees(state.speed, state.degreesPerStep);
 
-        if (index + 1 < _motorCount) _serial.print(",");
+        const TelemetrySample& last = _lastTelemetry[index];
+        if (((_telemetryFields & TELEMETRY_RUNNING) && sample.running != last.running) ||
+            ((_telemetryFields & TELEMETRY_POSITION) && sample.position != last.position) ||
+            ((_telemetryFields & TELEMETRY_SPEED) && sample.speed != last.speed))
+            changed = true;
+        _lastTelemetry[index] = sample;
     }
-    _serial.println();
 
+    _telemetrySent = true;
+    return changed;
+}
+
+void MovingSpeakerProtocol::renormalizeModuloMotors()
+{
     for (uint8_t index = 0; index < _motorCount; ++index) {
         if (_motors[index].modulo)
             _motors[index].stepper->renormalizePosition();
     }
 }
 
-void MovingSpeakerProtocol::processCommand(uint16_t length)
+void MovingSpeakerProtocol::processCommand(const char* fields, uint16_t length,
+                                           CommandAction action)
 {
-    constexpr uint8_t maxMotorChannels = 4;
     if (_motorCount > maxMotorChannels) {
-        _serial.println("E: Invalid protocol configuration");
+        sendError("Invalid protocol configuration");
         return;
     }
 
-    uint16_t commaCount = 0;
-    for (uint16_t index = 0; index < length; ++index) {
-        if (_buffer[index] == ',') ++commaCount;
+    // One pass over the line: every field is parsed and counted, the first
+    // invalid one is remembered and reported only if the count is right.
+    // After an optional `@<mask>,` the fields are those of the motors in
+    // the mask only.
+    ParsedMotorCommand commands[maxMotorChannels];
+    const char* error = nullptr;
+    const char* cursor = fields;
+    const char* end = fields + length;
+    uint8_t mask = allMotorsMask();
+    uint8_t slot = 0;
+    bool extraFields = false;
+
+    if (cursor < end && *cursor == '@') {
+        int32_t value = 0;
+        ++cursor;
+        bool valid = parseIntegerField(cursor, end, 1, 0xFF, value);
+        mask = (uint8_t)value;
+        if (!valid || !validMotorMask(mask)) {
+            sendError("Invalid frame: invalid motor mask");
+            return;
+        }
+        if (cursor < end) ++cursor;
     }
 
-    uint16_t expectedFields = 0;
-    for (uint8_t index = 0; index < _motorCount; ++index)
-        expectedFields += _motors[index].modulo ? 4 : 3;
+    uint8_t motor = 0;
+    while (motor < _motorCount && !(mask & (1U << motor))) ++motor;
+
+    for (;;) {
+        if (motor >= _motorCount) {
+            extraFields = true;
+            break;
+        }
+
+        ParsedMotorCommand& command = commands[motor];
+        bool modulo = _motors[motor].modulo;
+        int32_t value = 0;
+
+        if (modulo && slot == 2) {
+            if (!parseIntegerField(cursor, end, ROT_SHORTEST, ROT_CCW, value) && !error)
+                error = "Invalid frame: invalid rotation mode";
+            command.mode = (RotaryMode)value;
+        } else {
+            if (!parseMilliField(cursor, end, value) && !error)
+                error = "Invalid frame: invalid numeric field";
+            double field = value / (double)DECIMAL_FIELD_SCALE;
+            if (slot == 0) {
+                command.target = field;
+                command.mode = ROT_SHORTEST;
+            } else if (slot == 1) {
+                command.speed = field;
+            } else {
+                command.acceleration = field;
+            }
+        }
+
+        if (++slot == (modulo ? 4 : 3)) {
+            do {
+                ++motor;
+            } while (motor < _motorCount && !(mask & (1U << motor)));
+            slot = 0;
+        }
+
+        if (cursor >= end) break;
+        ++cursor;
+    }
+
+    if (extraFields || motor != _motorCount) {
+        sendError("Invalid frame: wrong number of fields");
+        return;
+    }
+
+    if (error) {
+        sendError(error);
+        return;
+    }
+
+    submitCommands(mask, commands, action);
+}
+
+// A plain command is held while _holdCommands is set; the one ending a
+// backlog is merged into the held ones, so each motor only gets its newest
+// fields. Anything else first applies the held commands so that the order
+// of the lines is kept.
+void MovingSpeakerProtocol::submitCommands(uint8_t mask,
+                                           const ParsedMotorCommand* commands,
+                                           CommandAction action)
+{
+    if (action == COMMAND_APPLY && (_holdCommands || _pendingLines > 0)) {
+        for (uint8_t index = 0; index < _motorCount; ++index) {
+            if (!(mask & (1U << index))) continue;
+            _pendingCommands[index] = commands[index];
+            _pendingOwners[index] = _pendingLines;
+        }
+        _pendingMask |= mask;
+        if (++_pendingLines >= maxCoalescedLines || !_holdCommands)
+            applyPendingCommands();
+        return;
+    }
+
+    applyPendingCommands();
+    if (!applyCommands(_motors, _motorCount, mask, commands, action)) {
+        sendError("Queue full");
+        return;
+    }
+    if (action == COMMAND_ENQUEUE) sendQueueFrame();
+}
+
+// A held line is counted as coalesced when no motor kept its command.
+void MovingSpeakerProtocol::applyPendingCommands()
+{
+    if (_pendingLines == 0) return;
+
+    uint8_t appliedLines = 0;
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        if (!(_pendingMask & (1U << index))) continue;
+        bool counted = false;
+        for (uint8_t other = 0; other < index; ++other) {
+            if ((_pendingMask & (1U << other)) &&
+                _pendingOwners[other] == _pendingOwners[index])
+                counted = true;
+        }
+        if (!counted) ++appliedLines;
+    }
+    _coalescedCommands += _pendingLines - appliedLines;
+
+    applyCommands(_motors, _motorCount, _pendingMask, _pendingCommands,
+                  COMMAND_APPLY);
+    _pendingMask = 0;
+    _pendingLines = 0;
+}
+
+void MovingSpeakerProtocol::setCoalescing(bool enabled)
+{
+    if (!enabled) applyPendingCommands();
+    _coalescing = enabled;
+}
+
+void MovingSpeakerProtocol::processCoalescing(const char* fields, uint16_t length)
+{
+    const char* cursor = fields;
+    int32_t enabled = 0;
+    if (!parseIntegerField(cursor, fields + length, 0, 1, enabled)) {
+        sendError("Invalid frame: invalid numeric field");
+        return;
+    }
+    setCoalescing(enabled != 0);
+    sendCoalescingFrame();
+}
+
+void MovingSpeakerProtocol::sendCoalescingFrame()
+{
+    if (_binary) {
+        _frame.beginBinary(BIN_COALESCING_STATE);
+        _frame.appendUint8(_coalescing);
+        _frame.appendInt32((int32_t)_coalescedCommands);
+        _frame.endBinary();
+    } else {
+        _frame.begin("C: ");
+        _frame.appendInteger(_coalescing);
+        _frame.appendChar(',');
+        _frame.appendInteger((long)_coalescedCommands);
+        _frame.end();
+    }
+    _frame.flush(_serial);
+}
+
+void MovingSpeakerProtocol::sendStateFrame()
+{
+    if (_binary) {
+        sendBinaryStateFrame();
+        return;
+    }
+
+    _frame.begin("S: ");
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        StepperState state;
+        _motors[index].stepper->readState(state);
+        _frame.appendInteger(state.running);
+        _frame.appendChar(',');
+        _frame.appendCentis(toCentidegrees(state.targetPosition, state.degreesPerStep));
+        _frame.appendChar(',');
+        _frame.appendCentis(toCentidegrees(state.maxSpeed, state.degreesPerStep));
+        _frame.appendChar(',');
+        _frame.appendCentis(toCentidegrees(state.acceleration, state.degreesPerStep));
+
+        if (index + 1 < _motorCount) _frame.appendChar(',');
+    }
+    _frame.end();
+    _frame.flush(_serial);
+}
+
+void MovingSpeakerProtocol::sendError(const char* message)
+{
+    if (!_binary) {
+        _serial.print("E: ");
+        _serial.println(message);
+        return;
+    }
+
+    _frame.beginBinary(BIN_ERROR);
+    while (*message) _frame.appendUint8((uint8_t)*message++);
+    _frame.endBinary();
+    _frame.flush(_serial);
+}
+
+void MovingSpeakerProtocol::processBinaryFrame(uint16_t length)
+{
+    uint8_t* frame = (uint8_t*)_buffer;
+    int16_t decoded = cobsDecodeInPlace(frame, length);
+    if (decoded < 3 ||
+        crc16Ccitt(frame, decoded - 2) != readUint16Le(frame + decoded - 2)) {
+        sendError("Invalid frame: bad checksum");
+        return;
+    }
+
+    uint16_t payloadLength = decoded - 2;
+    bool motion = frame[0] == BIN_SETPOINT ||
+                  (frame[0] == BIN_ADDRESSED && payloadLength > 1 &&
+                   frame[1] == COMMAND_APPLY);
+    if (!motion) applyPendingCommands();
+
+    switch (frame[0]) {
+    case BIN_SETPOINT:
+        processBinarySetpoint(frame + 1, payloadLength - 1, COMMAND_APPLY,
+                              allMotorsMask());
+        break;
+    case BIN_ENQUEUE:
+        processBinarySetpoint(frame + 1, payloadLength - 1, COMMAND_ENQUEUE,
+                              allMotorsMask());
+        break;
+    case BIN_COORDINATED:
+        processBinarySetpoint(frame + 1, payloadLength - 1, COMMAND_COORDINATED,
+                              allMotorsMask());
+        break;
+    case BIN_ADDRESSED:
+        processBinaryAddressed(frame + 1, payloadLength - 1);
+        break;
+    case BIN_COALESCING:
+        processBinaryCoalescing(frame + 1, payloadLength - 1);
+        break;
+    case BIN_FLUSH:
+        flushQueues();
+        break;
+    case BIN_QUEUE_REQUEST:
+        sendQueueFrame();
+        break;
+    case BIN_JERK:
+        processBinaryJerk(frame + 1, payloadLength - 1);
+        break;
+    case BIN_HALT:
+        processBinaryHalt(frame + 1, payloadLength - 1);
+        break;
+    case BIN_EMERGENCY_DECEL:
+        processBinaryEmergencyDecel(frame + 1, payloadLength - 1);
+        break;
+    case BIN_SUBSCRIBE:
+        processBinarySubscribe(frame + 1, payloadLength - 1);
+        break;
+    case BIN_MOTOR_CONFIG:
+        processBinaryMotorConfig(frame + 1, payloadLength - 1);
+        break;
+    case BIN_DIAGNOSTICS_REQUEST:
+        startDiagnostics();
+        break;
+    case BIN_STATE_REQUEST:
+        sendBinaryStateFrame();
+        break;
+    case BIN_INFO_REQUEST:
+        sendBinaryInfoFrame();
+        break;
+    case BIN_ASCII_MODE:
+        _binary = false;
+        _telemetrySent = false;
+        _assembler.setTerminator('\n');
+        _serial.println("I: ASCII mode");
+        break;
+    default:
+        sendError("Invalid frame: unknown type");
+        break;
+    }
+}
+
+// action, motor mask, then the setpoint fields of the motors in the mask.
+void MovingSpeakerProtocol::processBinaryAddressed(const uint8_t* fields,
+                                                   uint16_t length)
+{
+    if (length < 2) {
+        sendError("Invalid frame: wrong number of fields");
+        return;
+    }
+    if (fields[0] > COMMAND_COORDINATED) {
+        sendError("Invalid frame: invalid numeric field");
+        return;
+    }
+
+    uint8_t mask = fields[1];
+    if (!validMotorMask(mask)) {
+        sendError("Invalid frame: invalid motor mask");
+        return;
+    }
+    processBinarySetpoint(fields + 2, length - 2, (CommandAction)fields[0], mask);
+}
+
+void MovingSpeakerProtocol::processBinaryCoalescing(const uint8_t* fields,
+                                                    uint16_t length)
+{
+    if (length > 1) {
+        sendError("Invalid frame: wrong number of fields");
+        return;
+    }
+    if (length == 1) {
+        if (fields[0] > 1) {
+            sendError("Invalid frame: invalid numeric field");
+            return;
+        }
+        setCoalescing(fields[0] != 0);
+    }
+    sendCoalescingFrame();
+}
+
+void MovingSpeakerProtocol::processBinarySetpoint(const uint8_t* fields,
+                                                  uint16_t length,
+                                                  CommandAction action,
+                                                  uint8_t mask)
+{
+    if (_motorCount > maxMotorChannels) {
+        sendError("Invalid protocol configuration");
+        return;
+    }
 
-    if (commaCount != expectedFields - 1) {
-        _serial.println("E: Invalid frame: wrong number of fields");
+    uint16_t expectedLength = 0;
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        if (mask & (1U << index)) expectedLength += _motors[index].modulo ? 9 : 8;
+    }
+
+    if (length != expectedLength) {
+        sendError("Invalid frame: wrong number of fields");
         return;
     }
 
     ParsedMotorCommand commands[maxMotorChannels];
-    char* token = strtok(_buffer, ",");
     for (uint8_t index = 0; index < _motorCount; ++index) {
-        commands[index].mode = ROT_SHORTEST;
-        if (!parseDouble(token, commands[index].target)) return;
-        token = strtok(NULL, ",");
-        if (!parseDouble(token, commands[index].speed)) return;
+        if (!(mask & (1U << index))) continue;
+        commands[index].target = readInt32Le(fields) / 100.0;
+        commands[index].speed = readUint16Le(fields + 4) / 10.0;
+        fields += 6;
 
+        commands[index].mode = ROT_SHORTEST;
         if (_motors[index].modulo) {
-            token = strtok(NULL, ",");
-            if (!parseMode(token, commands[index].mode)) return;
+            if (*fields > ROT_CCW) {
+                sendError("Invalid frame: invalid rotation mode");
+                return;
+            }
+            commands[index].mode = (RotaryMode)*fields++;
         }
 
-        token = strtok(NULL, ",");
-        if (!parseDouble(token, commands[index].acceleration)) return;
-        token = strtok(NULL, ",");
+        commands[index].acceleration = readUint16Le(fields) / 10.0;
+        fields += 2;
     }
 
+    submitCommands(mask, commands, action);
+}
+
+void MovingSpeakerProtocol::sendBinaryStateFrame()
+{
+    _frame.beginBinary(BIN_STATE);
     for (uint8_t index = 0; index < _motorCount; ++index) {
-        _motors[index].stepper->applyCommandDegrees(
-            commands[index].target,
-            commands[index].speed,
-            commands[index].acceleration,
-            commands[index].mode,
-            _motors[index].modulo);
+        StepperState state;
+        _motors[index].stepper->readState(state);
+        _frame.appendUint8(state.running);
+        _frame.appendInt32(toCentidegrees(state.targetPosition, state.degreesPerStep));
+        _frame.appendUint16(toUnsigned16(
+            scaleDegrees(state.maxSpeed * state.degreesPerStep, 10)));
+        _frame.appendUint16(toUnsigned16(
+            scaleDegrees(state.acceleration * state.degreesPerStep, 10)));
     }
+    _frame.endBinary();
+    _frame.flush(_serial);
+}
 
+void MovingSpeakerProtocol::sendBinaryInfoFrame()
+{
+    _frame.beginBinary(BIN_INFO);
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        StepperCore& motor = *_motors[index].stepper;
+        _frame.appendInt32(scaleDegrees(motor.getMinPositionDeg(), 100));
+        _frame.appendInt32(scaleDegrees(motor.getMaxPositionDeg(), 100));
+        _frame.appendUint16(toUnsigned16(scaleDegrees(motor.getMaxSpeedDegMin(), 10)));
+        _frame.appendUint16(toUnsigned16(scaleDegrees(motor.getMaxSpeedDegMax(), 10)));
+        _frame.appendUint16(toUnsigned16(scaleDegrees(motor.getAccelDegMin(), 10)));
+        _frame.appendUint16(toUnsigned16(scaleDegrees(motor.getAccelDegMax(), 10)));
+    }
+    _frame.endBinary();
+    _frame.flush(_serial);
 }
 
-bool MovingSpeakerProtocol::parseDouble(char*& token, double& value)
+void MovingSpeakerProtocol::flushQueues()
 {
-    if (!token) {
-        _serial.println("E: Invalid frame: invalid numeric field");
-        return false;
+    for (uint8_t index = 0; index < _motorCount; ++index)
+        _motors[index].stepper->flushSegments();
+    sendQueueFrame();
+}
+
+void MovingSpeakerProtocol::sendQueueFrame()
+{
+    if (_binary) _frame.beginBinary(BIN_QUEUE);
+    else _frame.begin("Q: ");
+
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        uint8_t depth = _motors[index].stepper->queuedSegments();
+        if (_binary) {
+            _frame.appendUint8(depth);
+            continue;
+        }
+        _frame.appendInteger(depth);
+        if (index + 1 < _motorCount) _frame.appendChar(',');
     }
 
-    errno = 0;
-    char* end = nullptr;
-    value = strtod(token, &end);
-    while (end && isspace((unsigned char)*end)) ++end;
+    if (_binary) _frame.endBinary();
+    else _frame.end();
+    _frame.flush(_serial);
+}
 
-    if (end == token || *end != '\0' || errno == ERANGE || !isfinite(value)) {
-        _serial.println("E: Invalid frame: invalid numeric field");
-        return false;
+void MovingSpeakerProtocol::processJerk(const char* fields, uint16_t length)
+{
+    if (_motorCount > maxMotorChannels) {
+        sendError("Invalid protocol configuration");
+        return;
     }
-    return true;
+
+    int32_t jerks[maxMotorChannels];
+    const char* error =
+        parseMotorIntegers(fields, length, _motorCount, maxJerkDegrees, jerks);
+    if (error) {
+        sendError(error);
+        return;
+    }
+    applyJerk(jerks);
 }
 
-bool MovingSpeakerProtocol::parseMode(char*& token, RotaryMode& mode)
+void MovingSpeakerProtocol::processBinaryJerk(const uint8_t* fields,
+                                              uint16_t length)
 {
-    if (!token) {
-        _serial.println("E: Invalid frame: invalid rotation mode");
-        return false;
+    if (_motorCount > maxMotorChannels) {
+        sendError("Invalid protocol configuration");
+        return;
     }
 
-    errno = 0;
-    char* end = nullptr;
-    long parsedMode = strtol(token, &end, 10);
-    while (end && isspace((unsigned char)*end)) ++end;
+    if (length == 0) {
+        sendJerkFrame();
+        return;
+    }
 
-    if (end == token || *end != '\0' || errno == ERANGE ||
-        parsedMode < ROT_SHORTEST || parsedMode > ROT_CCW) {
-        _serial.println("E: Invalid frame: invalid rotation mode");
-        return false;
+    int32_t jerks[maxMotorChannels];
+    const char* error =
+        readMotorIntegers(fields, length, _motorCount, maxJerkDegrees, jerks);
+    if (error) {
+        sendError(error);
+        return;
     }
+    applyJerk(jerks);
+}
 
-    mode = (RotaryMode)parsedMode;
-    return true;
+// Jerk limits apply to moves planned from now on. Step scheduling only
+// knows the trapezoid, so it refuses anything but 0 on every motor alike.
+void MovingSpeakerProtocol::applyJerk(const int32_t* jerks)
+{
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        if (!_motors[index].stepper->setJerkDegrees(jerks[index])) {
+            sendError("Invalid frame: jerk not supported");
+            return;
+        }
+    }
+    sendJerkFrame();
 }
 
-void MovingSpeakerProtocol::sendStateFrame()
+void MovingSpeakerProtocol::sendJerkFrame()
+{
+    if (_binary) _frame.beginBinary(BIN_JERK_STATE);
+    else _frame.begin("J: ");
+
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        long jerk = lround(_motors[index].stepper->getJerkDeg());
+        if (_binary) {
+            _frame.appendInt32(jerk);
+            continue;
+        }
+        _frame.appendInteger(jerk);
+        if (index + 1 < _motorCount) _frame.appendChar(',');
+    }
+
+    if (_binary) _frame.endBinary();
+    else _frame.end();
+    _frame.flush(_serial);
+}
+
+// Commands held for coalescing were sent before the stop and are dropped
+// with the buffered lines. There is no reply; telemetry shows the motors
+// coming to rest.
+void MovingSpeakerProtocol::emergencyStop()
+{
+    _pendingMask = 0;
+    _pendingLines = 0;
+    haltMotors(allMotorsMask());
+    ++_emergencyStops;
+}
+
+void MovingSpeakerProtocol::haltMotors(uint8_t mask)
+{
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        if (mask & (1U << index)) _motors[index].stepper->emergencyStop();
+    }
+}
+
+void MovingSpeakerProtocol::processHalt(const char* fields, uint16_t length)
+{
+    uint8_t mask = allMotorsMask();
+    if (length > 0) {
+        const char* cursor = fields;
+        int32_t value = 0;
+        bool valid = parseIntegerField(cursor, fields + length, 1, 0xFF, value);
+        mask = (uint8_t)value;
+        if (!valid || !validMotorMask(mask)) {
+            sendError("Invalid frame: invalid motor mask");
+            return;
+        }
+    }
+    haltMotors(mask);
+    sendHaltFrame(mask);
+}
+
+void MovingSpeakerProtocol::processBinaryHalt(const uint8_t* fields,
+                                              uint16_t length)
+{
+    if (length > 1) {
+        sendError("Invalid frame: wrong number of fields");
+        return;
+    }
+
+    uint8_t mask = allMotorsMask();
+    if (length == 1) {
+        mask = fields[0];
+        if (!validMotorMask(mask)) {
+            sendError("Invalid frame: invalid motor mask");
+            return;
+        }
+    }
+    haltMotors(mask);
+    sendHaltFrame(mask);
+}
+
+void MovingSpeakerProtocol::sendHaltFrame(uint8_t mask)
+{
+    if (_binary) {
+        _frame.beginBinary(BIN_HALT_STATE);
+        _frame.appendUint8(mask);
+        _frame.endBinary();
+    } else {
+        _frame.begin("H: ");
+        _frame.appendInteger(mask);
+        _frame.end();
+    }
+    _frame.flush(_serial);
+}
+
+void MovingSpeakerProtocol::processEmergencyDecel(const char* fields,
+                                                  uint16_t length)
+{
+    if (_motorCount > maxMotorChannels) {
+        sendError("Invalid protocol configuration");
+        return;
+    }
+
+    int32_t decelerations[maxMotorChannels];
+    const char* error = parseMotorIntegers(fields, length, _motorCount,
+                                           maxEmergencyDecelDegrees,
+                                           decelerations);
+    if (error) {
+        sendError(error);
+        return;
+    }
+    applyEmergencyDecel(decelerations);
+}
+
+void MovingSpeakerProtocol::processBinaryEmergencyDecel(const uint8_t* fields,
+                                                        uint16_t length)
+{
+    if (_motorCount > maxMotorChannels) {
+        sendError("Invalid protocol configuration");
+        return;
+    }
+
+    if (length == 0) {
+        sendEmergencyDecelFrame();
+        return;
+    }
+
+    int32_t decelerations[maxMotorChannels];
+    const char* error = readMotorIntegers(fields, length, _motorCount,
+                                          maxEmergencyDecelDegrees,
+                                          decelerations);
+    if (error) {
+        sendError(error);
+        return;
+    }
+    applyEmergencyDecel(decelerations);
+}
+
+void MovingSpeakerProtocol::applyEmergencyDecel(const int32_t* decelerations)
+{
+    for (uint8_t index = 0; index < _motorCount; ++index)
+        _motors[index].stepper->setEmergencyDecelDegrees(decelerations[index]);
+    sendEmergencyDecelFrame();
+}
+
+// Values are clamped to the acceleration bounds of each motor; 0 stands
+// for the maximum acceleration.
+void MovingSpeakerProtocol::sendEmergencyDecelFrame()
+{
+    if (_binary) _frame.beginBinary(BIN_EMERGENCY_DECEL_STATE);
+    else _frame.begin("K: ");
+
+    for (uint8_t index = 0; index < _motorCount; ++index) {
+        long deceleration = lround(_motors[index].stepper->getEmergencyDecelDeg());
+        if (_binary) {
+            _frame.appendInt32(deceleration);
+            continue;
+        }
+        _frame.appendInteger(deceleration);
+        if (index + 1 < _motorCount) _frame.appendChar(',');
+    }
+
+    if (_binary) _frame.endBinary();
+    else _frame.end();
+    _frame.flush(_serial);
+}
+
+void MovingSpeakerProtocol::processSubscribe(const char* fields, uint16_t length)
+{
+    // period, motor mask, field mask, change-only flag
+    static const int32_t minimums[4] = { 0, 1, 1, 0 };
+    static const int32_t maximums[4] = { 60000, 0xFF, TELEMETRY_ALL, 1 };
+    int32_t values[4];
+    const char* error = nullptr;
+    const char* cursor = fields;
+    const char* end = fields + length;
+    uint8_t count = 0;
+
+    for (;;) {
+        if (count >= 4) {
+            error = "Invalid frame: wrong number of fields";
+            break;
+        }
+        if (!parseIntegerField(cursor, end, minimums[count], maximums[count],
+                               values[count]) && !error)
+            error = "Invalid frame: invalid numeric field";
+        ++count;
+
+        if (cursor >= end) break;
+        ++cursor;
+    }
+
+    if (count != 4) error = "Invalid frame: wrong number of fields";
+    if (error) {
+        sendError(error);
+        return;
+    }
+    applySubscription((uint16_t)values[0], (uint8_t)values[1],
+                      (uint8_t)values[2], values[3] != 0);
+}
+
+void MovingSpeakerProtocol::processBinarySubscribe(const uint8_t* fields,
+                                                   uint16_t length)
+{
+    if (length == 0) {
+        sendSubscriptionFrame();
+        return;
+    }
+
+    if (length != 5) {
+        sendError("Invalid frame: wrong number of fields");
+        return;
+    }
+
+    uint16_t period = readUint16Le(fields);
+    if (period > 60000 || fields[2] == 0 || fields[3] == 0 ||
+        fields[3] > TELEMETRY_ALL || fields[4] > 1) {
+        sendError("Invalid frame: invalid numeric field");
+        return;
+    }
+    applySubscription(period, fields[2], fields[3], fields[4] != 0);
+}
+
+// Periods below 5 ms are raised to 5 ms; a frame is still only started
+// once the previous one has left, so the line rate bounds the actual rate.
+// Motors beyond the target's count are ignored.
+void MovingSpeakerProtocol::applySubscription(uint16_t period, uint8_t motors,
+                                              uint8_t fields, bool onChange)
+{
+    motors &= allMotorsMask();
+    if (motors == 0) {
+        sendError("Invalid frame: invalid numeric field");
+        return;
+    }
+
+    _telemetryPeriod = period != 0 && period < 5 ? 5 : period;
+    _telemetryMotors = motors;
+    _telemetryFields = fields;
+    _telemetryOnChange = onChange;
+    _telemetrySent = false;
+    sendSubscriptionFrame();
+}
+
+void MovingSpeakerProtocol::sendSubscriptionFrame()
+{
+    if (_binary) {
+        _frame.beginBinary(BIN_SUBSCRIPTION);
+        _frame.appendUint16(_telemetryPeriod);
+        _frame.appendUint8(_telemetryMotors);
+        _frame.appendUint8(_telemetryFields);
+        _frame.appendUint8(_telemetryOnChange);
+        _frame.endBinary();
+    } else {
+        _frame.begin("U: ");
+        _frame.appendInteger(_telemetryPeriod);
+        _frame.appendChar(',');
+        _frame.appendInteger(_telemetryMotors);
+        _frame.appendChar(',');
+        _frame.appendInteger(_telemetryFields);
+        _frame.appendChar(',');
+        _frame.appendInteger(_telemetryOnChange);
+        _frame.end();
+    }
+    _frame.flush(_serial);
+}
+
+void MovingSpeakerProtocol::processMotorConfig(const char* fields, uint16_t length)
+{
+    // motor, steps per revolution, min and max position, timer period
+    int32_t values[5];
+    const char* error = nullptr;
+    const char* cursor = fields;
+    const char* end = fields + length;
+    uint8_t count = 0;
+
+    for (;;) {
+        if (count >= 5) {
+            error = "Invalid frame: wrong number of fields";
+            break;
+        }
+
+        bool valid;
+        if (count == 0)
+            valid = parseIntegerField(cursor, end, 0, _motorCount - 1, values[0]);
+        else if (count == 1)
+            valid = parseIntegerField(cursor, end, 1, maxStepsPerRev, values[1]);
+        else if (count == 4)
+            valid = parseIntegerField(cursor, end, minTimerPeriodUs,
+                                      maxTimerPeriodUs, values[4]);
+        else
+            valid = parseMilliField(cursor, end, values[count]);
+        if (!valid && !error) error = "Invalid frame: invalid numeric field";
+        ++count;
+
+        if (cursor >= end) break;
+        ++cursor;
+    }
+
+    if (count != 1 && count != 5) error = "Invalid frame: wrong number of fields";
+    if (error) {
+        sendError(error);
+        return;
+    }
+
+    if (count == 1) {
+        sendMotorConfigFrame((uint8_t)values[0]);
+        return;
+    }
+    applyMotorConfig((uint8_t)values[0], values[1], lround(values[2] / 10.0),
+                     lround(values[3] / 10.0), (uint32_t)values[4]);
+}
+
+void MovingSpeakerProtocol::processBinaryMotorConfig(const uint8_t* fields,
+                                                     uint16_t length)
+{
+    if (length != 1 && length != 15) {
+        sendError("Invalid frame: wrong number of fields");
+        return;
+    }
+
+    if (fields[0] >= _motorCount) {
+        sendError("Invalid frame: invalid numeric field");
+        return;
+    }
+
+    if (length == 1) {
+        sendMotorConfigFrame(fields[0]);
+        return;
+    }
+
+    int32_t stepsPerRev = readInt32Le(fields + 1);
+    uint16_t periodUs = readUint16Le(fields + 13);
+    if (stepsPerRev < 1 || stepsPerRev > maxStepsPerRev ||
+        periodUs < minTimerPeriodUs || periodUs > maxTimerPeriodUs) {
+        sendError("Invalid frame: invalid numeric field");
+        return;
+    }
+    applyMotorConfig(fields[0], stepsPerRev, readInt32Le(fields + 5),
+                     readInt32Le(fields + 9), periodUs);
+}
+
+// A new timer period applies to every motor sharing the interrupt, so all
+// motors of the group have to be stopped, not only the one configured.
+// Every motor concerned is checked before the timer or any motor is
+// touched, so that a refused command changes nothing.
+void MovingSpeakerProtocol::applyMotorConfig(uint8_t motor, long stepsPerRev,
+                                             long minCentis, long maxCentis,
+                                             uint32_t periodUs)
 {
-    _serial.print("S: ");
+    if (minCentis >= maxCentis) {
+        sendError("Invalid frame: invalid numeric field");
+        return;
+    }
+
+    StepperCore& stepper = *_motors[motor].stepper;
+    double period = periodUs * 1e-6;
+    uint32_t currentUs = (uint32_t)lround(stepper.getTimerPeriod() * 1e6);
+    uint8_t group = _motors[motor].group;
+    bool retime = periodUs != currentUs;
+
     for (uint8_t index = 0; index < _motorCount; ++index) {
+        if (index != motor && (!retime || _motors[index].group != group))
+            continue;
         StepperState state;
         _motors[index].stepper->readState(state);
-        _serial.print(state.running);
-        _serial.print(",");
-        _serial.print((double)state.targetPosition * 360.0 / state.stepsPerRev);
-        _serial.print(",");
-        _serial.print(state.maxSpeed * 360.0 / state.stepsPerRev);
-        _serial.print(",");
-        _serial.print(state.acceleration * 360.0 / state.stepsPerRev);
+        if (state.running) {
+            sendError("Invalid frame: motor running");
+            return;
+        }
+        if (!_motors[index].stepper->canReconfigure(period)) {
+            sendError("Invalid frame: unsupported timer period");
+            return;
+        }
+    }
 
-        if (index + 1 < _motorCount) _serial.print(",");
+    if (retime && (!_timerPeriodHandler || !_timerPeriodHandler(group, periodUs))) {
+        sendError("Invalid frame: unsupported timer period");
+        return;
     }
-    _serial.println();
-}
\ No newline at end of file
+
+    long minPos = lround(minCentis * (double)stepsPerRev / 36000.0);
+    long maxPos = lround(maxCentis * (double)stepsPerRev / 36000.0);
+    stepper.reconfigure(stepsPerRev, minPos, maxPos, period);
+    for (uint8_t index = 0; retime && index < _motorCount; ++index) {
+        StepperCore& other = *_motors[index].stepper;
+        if (index == motor || _motors[index].group != group) continue;
+        other.reconfigure(other.getStepsPerRev(), other.getMinPosition(),
+                          other.getMaxPosition(), period);
+    }
+    sendMotorConfigFrame(motor);
+}
+
+void MovingSpeakerProtocol::sendMotorConfigFrame(uint8_t motor)
+{
+    StepperCore& stepper = *_motors[motor].stepper;
+    long minCentis = scaleDegrees(stepper.getMinPositionDeg(), 100);
+    long maxCentis = scaleDegrees(stepper.getMaxPositionDeg(), 100);
+    long periodUs = lround(stepper.getTimerPeriod() * 1e6);
+
+    if (_binary) {
+        _frame.beginBinary(BIN_MOTOR_STATE);
+        _frame.appendUint8(motor);
+        _frame.appendInt32(stepper.getStepsPerRev());
+        _frame.appendInt32(minCentis);
+        _frame.appendInt32(maxCentis);
+        _frame.appendUint16((uint16_t)periodUs);
+        _frame.endBinary();
+    } else {
+        _frame.begin("M: ");
+        _frame.appendInteger(motor);
+        _frame.appendChar(',');
+        _frame.appendInteger(stepper.getStepsPerRev());
+        _frame.appendChar(',');
+        _frame.appendCentis(minCentis);
+        _frame.appendChar(',');
+        _frame.appendCentis(maxCentis);
+        _frame.appendChar(',');
+        _frame.appendInteger(periodUs);
+        _frame.end();
+    }
+    _frame.flush(_serial);
+}
+
+// The report is a header with the number of motor and interrupt probes,
+// then one frame per probe sent from process() as the port frees up. Each
+// probe is reset as its frame is built.
+void MovingSpeakerProtocol::startDiagnostics()
+{
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+    if (_binary) {
+        _frame.beginBinary(BIN_DIAGNOSTICS);
+        _frame.appendUint8(_motorCount);
+        _frame.appendUint8(_isrProbeCount);
+        _frame.endBinary();
+    } else {
+        _frame.begin("D: ");
+        _frame.appendInteger(_motorCount);
+        _frame.appendChar(',');
+        _frame.appendInteger(_isrProbeCount);
+        _frame.end();
+    }
+    _frame.flush(_serial);
+    _diagnosticsSource = 0;
+    _diagnosticsPending = true;
+#else
+    sendError("Invalid frame: diagnostics disabled");
+#endif
+}
+
+void MovingSpeakerProtocol::sendDiagnosticsFrame()
+{
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+    uint8_t source = _diagnosticsSource++;
+    if (_diagnosticsSource >= _motorCount + _isrProbeCount)
+        _diagnosticsPending = false;
+
+    IsrTimingStats stats;
+    if (source < _motorCount) _motors[source].stepper->isrProbe().takeStats(stats);
+    else _isrProbes[source - _motorCount].takeStats(stats);
+
+    // Times in 0.01 us.
+    double scale = 100.0 / diagnosticsCountsPerUs();
+    long times[4] = {
+        lround(stats.minTime * scale),
+        stats.calls ? lround((double)stats.totalTime / stats.calls * scale) : 0,
+        lround(stats.maxTime * scale),
+        lround(stats.maxJitter * scale),
+    };
+
+    if (_binary) {
+        _frame.beginBinary(BIN_DIAGNOSTICS_SOURCE);
+        _frame.appendUint8(source);
+        _frame.appendInt32((int32_t)stats.calls);
+        for (uint8_t index = 0; index < 4; ++index) _frame.appendInt32(times[index]);
+        _frame.appendInt32((int32_t)stats.overruns);
+        _frame.endBinary();
+    } else {
+        _frame.begin("D: ");
+        _frame.appendInteger(source);
+        _frame.appendChar(',');
+        _frame.appendInteger((long)stats.calls);
+        for (uint8_t index = 0; index < 4; ++index) {
+            _frame.appendChar(',');
+            _frame.appendCentis(times[index]);
+        }
+        _frame.appendChar(',');
+        _frame.appendInteger((long)stats.overruns);
+        _frame.end();
+    }
+    _frame.flush(_serial);
+#endif
+}
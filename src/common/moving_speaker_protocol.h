@@ -3,11 +3,53 @@
 
 #include <Arduino.h>
 #include "stepper_core.h"
+#include "line_assembler.h"
+#include "frame_builder.h"
 
+// Motors sharing a group arrive together on a coordinated move (G).
 struct MotorChannel
 {
     StepperCore* stepper;
     bool modulo;
+    uint8_t group;
+};
+
+#define PROTOCOL_MAX_MOTORS 4
+
+// Fields of the periodic P frame, selected with the U command.
+enum TelemetryField : uint8_t {
+    TELEMETRY_RUNNING = 0x01,
+    TELEMETRY_POSITION = 0x02,
+    TELEMETRY_SPEED = 0x04,
+    TELEMETRY_ALL = 0x07,
+};
+
+// Values of one motor as last written to a P frame, in the units of the
+// current mode.
+struct TelemetrySample
+{
+    bool running;
+    long position;
+    long speed;
+};
+
+// Reprograms the timer interrupt serving the motors of a group to the
+// given period. Returns false when the target cannot run at that period.
+typedef bool (*TimerPeriodHandler)(uint8_t group, uint32_t periodUs);
+
+// One motor's fields of a motion command, in degrees.
+struct ParsedMotorCommand
+{
+    double target;
+    double speed;
+    double acceleration;
+    RotaryMode mode;
+};
+
+enum CommandAction : uint8_t {
+    COMMAND_APPLY,
+    COMMAND_ENQUEUE,
+    COMMAND_COORDINATED,
 };
 
 class MovingSpeakerProtocol
@@ -18,22 +60,149 @@ class MovingSpeakerProtocol
                               uint8_t motorCount,
                               const char* infoTitle);
 
+        static constexpr uint16_t LINE_SIZE = 200;
+
         void process();
         void sendInfoFrame();
 
+        // The steps of process() for targets that run them from separate
+        // tasks, each call made under the caller's lock. receiveLine()
+        // returns the next complete line or -1; pollInput() only reads the
+        // port and acts on a stop byte, for a caller that cannot take a
+        // line yet. A frame started by any of them is left pending:
+        // flushOutput() hands the port what it takes and returns true once
+        // everything is out, and handleLine() and sendTelemetry() are only
+        // called then.
+        int16_t receiveLine(char* line, uint16_t capacity);
+        void pollInput();
+        bool flushOutput();
+        // lineQueued tells that another line is already waiting, which
+        // lets a plain motion command be coalesced with the next one.
+        void handleLine(const char* line, uint16_t length, bool lineQueued);
+        void serviceMotion();
+        void sendTelemetry();
+        uint16_t getTelemetryPeriod() { return _telemetryPeriod; }
+
+        // With coalescing, a plain motion command followed by more complete
+        // lines is held back and only the newest command per motor is
+        // applied, up to the next other line or the end of the backlog.
+        // Also switched with the C command.
+        void setCoalescing(bool enabled);
+        uint32_t getCoalescedCommands() { return _coalescedCommands; }
+
+        // Stop requests served so far. A task that queues lines drops them
+        // when this changes, as the stop also drops the lines buffered here.
+        uint32_t getEmergencyStops() { return _emergencyStops; }
+
+        // Without a handler the M command can change gearing and limits
+        // but not the timer period.
+        void setTimerPeriodHandler(TimerPeriodHandler handler)
+        {
+            _timerPeriodHandler = handler;
+        }
+
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+        // Timer interrupt probes reported by D after those of the motors.
+        void setIsrProbes(IsrProbe* probes, uint8_t count)
+        {
+            _isrProbes = probes;
+            _isrProbeCount = count;
+        }
+#endif
+
     private:
+        uint8_t allMotorsMask() { return (uint8_t)((1U << _motorCount) - 1); }
+        // At least one motor, and none the target does not have.
+        bool validMotorMask(uint32_t mask)
+        {
+            return mask != 0 && (mask & ~(uint32_t)allMotorsMask()) == 0;
+        }
         void sendPositionFrame();
-        void processCommand(uint16_t length);
-        bool parseDouble(char*& token, double& value);
-        bool parseMode(char*& token, RotaryMode& mode);
+        void processLine(uint16_t length);
+        void processCommand(const char* fields, uint16_t length,
+                            CommandAction action);
+        void submitCommands(uint8_t mask, const ParsedMotorCommand* commands,
+                            CommandAction action);
+        void applyPendingCommands();
+        void processCoalescing(const char* fields, uint16_t length);
+        void sendCoalescingFrame();
         void sendStateFrame();
+        void sendError(const char* message);
+        void sendQueueFrame();
+        void flushQueues();
+        void processSubscribe(const char* fields, uint16_t length);
+        void applySubscription(uint16_t period, uint8_t motors, uint8_t fields,
+                               bool onChange);
+        void sendSubscriptionFrame();
+        bool sampleTelemetry(TelemetrySample* samples);
+        void renormalizeModuloMotors();
+        void processMotorConfig(const char* fields, uint16_t length);
+        void applyMotorConfig(uint8_t motor, long stepsPerRev, long minCentis,
+                              long maxCentis, uint32_t periodUs);
+        void sendMotorConfigFrame(uint8_t motor);
+        void processJerk(const char* fields, uint16_t length);
+        void applyJerk(const int32_t* jerks);
+        void sendJerkFrame();
+        void emergencyStop();
+        void haltMotors(uint8_t mask);
+        void processHalt(const char* fields, uint16_t length);
+        void sendHaltFrame(uint8_t mask);
+        void processEmergencyDecel(const char* fields, uint16_t length);
+        void applyEmergencyDecel(const int32_t* decelerations);
+        void sendEmergencyDecelFrame();
+        void startDiagnostics();
+        void sendDiagnosticsFrame();
+
+        void processBinaryFrame(uint16_t length);
+        void processBinarySetpoint(const uint8_t* fields, uint16_t length,
+                                   CommandAction action, uint8_t mask);
+        void processBinaryAddressed(const uint8_t* fields, uint16_t length);
+        void processBinaryCoalescing(const uint8_t* fields, uint16_t length);
+        void processBinaryJerk(const uint8_t* fields, uint16_t length);
+        void processBinaryHalt(const uint8_t* fields, uint16_t length);
+        void processBinaryEmergencyDecel(const uint8_t* fields, uint16_t length);
+        void processBinarySubscribe(const uint8_t* fields, uint16_t length);
+        void processBinaryMotorConfig(const uint8_t* fields, uint16_t length);
+        void sendBinaryStateFrame();
+        void sendBinaryInfoFrame();
 
         Stream& _serial;
         MotorChannel* _motors;
         uint8_t _motorCount;
         const char* _infoTitle;
+        TimerPeriodHandler _timerPeriodHandler = nullptr;
         unsigned long _lastPositionFrame = 0;
-        char _buffer[200];
+
+        // Telemetry subscription: P frame period in ms (0 for none), motor
+        // and field masks, and whether unchanged frames are skipped.
+        uint16_t _telemetryPeriod = 100;
+        uint8_t _telemetryMotors = 0xFF;
+        uint8_t _telemetryFields = TELEMETRY_ALL;
+        bool _telemetryOnChange = false;
+        bool _telemetrySent = false;
+        TelemetrySample _lastTelemetry[PROTOCOL_MAX_MOTORS];
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+        // D report in progress: the next source to send, motors first.
+        IsrProbe* _isrProbes = nullptr;
+        uint8_t _isrProbeCount = 0;
+        uint8_t _diagnosticsSource = 0;
+        bool _diagnosticsPending = false;
+#endif
+        // Coalesced motion commands waiting to be applied: the motors they
+        // cover, the newest fields per motor with the held line they came
+        // from, and the number of held lines.
+        bool _coalescing = false;
+        bool _holdCommands = false;
+        uint8_t _pendingMask = 0;
+        uint8_t _pendingLines = 0;
+        uint8_t _pendingOwners[PROTOCOL_MAX_MOTORS];
+        ParsedMotorCommand _pendingCommands[PROTOCOL_MAX_MOTORS];
+        uint32_t _coalescedCommands = 0;
+        uint32_t _emergencyStops = 0;
+        bool _binary = false;
+        char _buffer[LINE_SIZE];
+        LineAssembler _assembler;
+        FrameBuilder _frame;
 };
 
 #endif
\ No newline at end of file
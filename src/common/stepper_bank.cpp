@@ -0,0 +1,125 @@
+#include "stepper_bank.h"
+
+#if defined(ARDUINO_ARCH_ESP32)
+#include <soc/soc.h>
+#include <soc/gpio_reg.h>
+#endif
+
+#if !defined(STEPPER_STEP_SCHEDULING)
+bool StepperBank::add(StepperCore& stepper)
+{
+    if (_count >= STEPPER_BANK_MAX_MOTORS) return false;
+
+    uint8_t stepPin = stepper.getStepPin();
+    uint8_t dirPin = stepper.getDirPin();
+
+#if defined(ARDUINO_ARCH_AVR)
+    uint8_t port = digitalPinToPort(stepPin);
+    if (port == NOT_A_PIN || digitalPinToPort(dirPin) != port) return false;
+    volatile uint8_t* output = portOutputRegister(port);
+    if (_port && output != _port) return false;
+
+    _port = output;
+    _stepMasks[_count] = digitalPinToBitMask(stepPin);
+    _dirMasks[_count] = digitalPinToBitMask(dirPin);
+#else
+    if (stepPin >= 32 || dirPin >= 32) return false;
+
+    _stepMasks[_count] = 1UL << stepPin;
+    _dirMasks[_count] = 1UL << dirPin;
+#endif
+
+    _motors[_count++] = &stepper;
+    return true;
+}
+
+void StepperBank::RunISR()
+{
+#if defined(STEPPER_TWO_PHASE_PULSE)
+    if (_pulseMask) {
+        clearPins(_pulseMask);
+        _pulseMask = 0;
+    }
+#endif
+
+    StepperPortMask steps = 0;
+    StepperPortMask forward = 0;
+    StepperPortMask backward = 0;
+
+    for (uint8_t index = 0; index < _count; ++index) {
+        ISR_PROBE_BEGIN(_motors[index]->isrProbe());
+        int8_t direction = _motors[index]->advanceTick();
+        ISR_PROBE_END(_motors[index]->isrProbe());
+        if (direction == 0) continue;
+
+        steps |= _stepMasks[index];
+        if (direction > 0) forward |= _dirMasks[index];
+        else backward |= _dirMasks[index];
+    }
+
+    if (steps == 0) return;
+
+    writeDirections(forward, backward);
+    setPins(steps);
+#if defined(STEPPER_TWO_PHASE_PULSE)
+    _pulseMask = steps;
+#else
+    delayMicroseconds(STEPPER_PULSE_WIDTH_US);
+    clearPins(steps);
+#endif
+}
+
+#if defined(ARDUINO_ARCH_ESP32)
+void StepperBank::writeDirections(StepperPortMask forward,
+                                  StepperPortMask backward)
+{
+    if (forward) REG_WRITE(GPIO_OUT_W1TS_REG, forward);
+    if (backward) REG_WRITE(GPIO_OUT_W1TC_REG, backward);
+}
+
+void StepperBank::setPins(StepperPortMask mask)
+{
+    REG_WRITE(GPIO_OUT_W1TS_REG, mask);
+}
+
+void StepperBank::clearPins(StepperPortMask mask)
+{
+    REG_WRITE(GPIO_OUT_W1TC_REG, mask);
+}
+#elif defined(ARDUINO_ARCH_AVR)
+// Called from the timer interrupt, so the read-modify-write of the port
+// cannot be interleaved with another interrupt.
+void StepperBank::writeDirections(StepperPortMask forward,
+                                  StepperPortMask backward)
+{
+    *_port = (*_port & ~backward) | forward;
+}
+
+void StepperBank::setPins(StepperPortMask mask)
+{
+    *_port |= mask;
+}
+
+void StepperBank::clearPins(StepperPortMask mask)
+{
+    *_port &= ~mask;
+}
+#else
+void StepperBank::writeDirections(StepperPortMask forward,
+                                  StepperPortMask backward)
+{
+    if (forward) nativePortSet(forward);
+    if (backward) nativePortClear(backward);
+}
+
+void StepperBank::setPins(StepperPortMask mask)
+{
+    nativePortSet(mask);
+}
+
+void StepperBank::clearPins(StepperPortMask mask)
+{
+    nativePortClear(mask);
+}
+#endif
+#endif
@@ -0,0 +1,53 @@
+#ifndef STEPPER_BANK_H
+#define STEPPER_BANK_H
+
+#include "stepper_core.h"
+
+// Runs the tick kernel of several motors from one timer interrupt. The
+// interrupt walks the motors and their step and dir bits as parallel
+// arrays and emits the steps of a pass together: the dir bits with one
+// write per level, then every step pin raised in one write and lowered in
+// one after a single shared pulse wait. With STEPPER_TWO_PHASE_PULSE the
+// pins raised in a pass are lowered in one write at the start of the next.
+//
+// All pins must be on one output port: GPIO 0 to 31 on ESP32, a single
+// PORTx register on AVR.
+#define STEPPER_BANK_MAX_MOTORS 8
+
+#if defined(ARDUINO_ARCH_AVR)
+typedef uint8_t StepperPortMask;
+#else
+typedef uint32_t StepperPortMask;
+#endif
+
+#if !defined(STEPPER_STEP_SCHEDULING)
+class StepperBank
+{
+    public:
+        // Fails when the bank is full or a pin is not on the bank's port.
+        // Call before the timer starts.
+        bool add(StepperCore& stepper);
+        uint8_t size() { return _count; }
+
+        void STEPPER_IRAM_ATTR RunISR();
+
+    private:
+        void STEPPER_IRAM_ATTR writeDirections(StepperPortMask forward,
+                                               StepperPortMask backward);
+        void STEPPER_IRAM_ATTR setPins(StepperPortMask mask);
+        void STEPPER_IRAM_ATTR clearPins(StepperPortMask mask);
+
+        StepperCore* _motors[STEPPER_BANK_MAX_MOTORS];
+        StepperPortMask _stepMasks[STEPPER_BANK_MAX_MOTORS];
+        StepperPortMask _dirMasks[STEPPER_BANK_MAX_MOTORS];
+        uint8_t _count = 0;
+#if defined(STEPPER_TWO_PHASE_PULSE)
+        StepperPortMask _pulseMask = 0;
+#endif
+#if defined(ARDUINO_ARCH_AVR)
+        volatile uint8_t* _port = nullptr;
+#endif
+};
+#endif
+
+#endif
@@ -1,90 +1,643 @@
 #include "stepper_core.h"
 #include <digitalWriteFast.h>
 
+namespace {
+#if defined(STEPPER_STEP_SCHEDULING)
+uint32_t toIntervalQ8(double seconds)
+{
+    double interval = seconds * 256e6;
+    if (interval >= 2147483647.0) return 2147483647UL;
+    if (interval < 256.0) return 256;
+    return (uint32_t)(interval + 0.5);
+}
+
+// First interval of a ramp from rest, with the usual 0.676 correction of
+// the c(n) recurrence for the first step.
+uint32_t firstIntervalQ8(double acceleration, uint32_t minInterval)
+{
+    uint32_t interval = toIntervalQ8(0.676 * sqrt(2.0 / acceleration));
+    return interval > minInterval ? interval : minInterval;
+}
+#elif defined(STEPPER_FIXED_POINT)
+StepperTick toTick(double value)
+{
+    if (value <= 0.0) return 0;
+    if (value >= 1.0) return STEPPER_Q30_ONE;
+    return (int32_t)(value * STEPPER_Q30_ONE + 0.5);
+}
+
+inline StepperTickSquare tickSquare(StepperTickSquare value)
+{
+    return (value * value) >> 30;
+}
+
+inline StepperTickSquare tickProduct(StepperTickSquare left,
+                                     StepperTickSquare right)
+{
+    return (left * right) >> 30;
+}
+#else
+StepperTick toTick(double value)
+{
+    return value;
+}
+
+inline StepperTickSquare tickSquare(StepperTickSquare value)
+{
+    return value * value;
+}
+
+inline StepperTickSquare tickProduct(StepperTickSquare left,
+                                     StepperTickSquare right)
+{
+    return left * right;
+}
+#endif
+
+// Keeps the compiler from moving plan writes across the pending flag.
+inline void compilerBarrier()
+{
+    __asm__ __volatile__("" ::: "memory");
+}
+
+// Duration of a trapezoidal move from rest to rest, or of the triangular
+// one when the distance is too short to reach speed.
+double trapezoidDuration(double distance, double speed, double acceleration)
+{
+    if (distance <= 0.0) return 0.0;
+    if (distance * acceleration >= speed * speed)
+        return distance / speed + speed / acceleration;
+    return 2.0 * sqrt(distance / acceleration);
+}
+}
+
 void StepperCore::Setup(uint8_t stepPin, uint8_t dirPin,
                         double timerPeriodSec, long steps_per_rev,
                         long minPos, long maxPos)
 {
     configurePins(stepPin, dirPin);
     configureMotion(timerPeriodSec, steps_per_rev, minPos, maxPos);
+    homePosition();
 
     pinModeFast(_stepPin, OUTPUT);
     pinModeFast(_dirPin, OUTPUT);
 }
 
+// Reads the snapshot of the last interrupt instead of masking it, so that
+// telemetry does not delay the steps. _planPending and _segmentReady are
+// read first: once the interrupt has taken the plan or the segment, the
+// snapshot after it shows the motor moving. A plan not taken yet counts as
+// under way, towards its target.
 void StepperCore::readState(StepperState& state)
 {
-    enterCritical();
-    state.position = _position;
-    state.positionModulo = _position % _steps_per_rev;
-    if (state.positionModulo < 0) state.positionModulo += _steps_per_rev;
-    state.targetPosition = _targetPos;
+    bool planPending = _planPending;
+    bool segmentReady = _segmentReady;
+    StepperSnapshot snapshot;
+    readSnapshot(snapshot);
+
+    state.position = snapshot.position;
+    state.positionModulo = wrapPosition(snapshot.position);
+    state.targetPosition = planPending ? _plannedTarget : snapshot.target;
     state.stepsPerRev = _steps_per_rev;
-    state.speed = _curSpeed;
+    state.degreesPerStep = _degreesPerStep;
     state.maxSpeed = _vmax;
     state.acceleration = _accel;
-    state.running = !(_position == _targetPos && _curSpeed == 0.0 &&
-                      _accSteps == 0.0 && !_reversing);
-    leaveCritical();
+    state.running = snapshot.moving || planPending || segmentReady ||
+                    _segmentCount > 0;
+    state.speed = speedStepsPerSec(snapshot.speed);
 }
 
-void StepperCore::applyCommandDegrees(double targetDeg, double speedDeg,
-                                      double accelerationDeg, RotaryMode mode,
-                                      bool modulo)
+void StepperCore::publishSnapshot()
 {
-    long target = (long)round(targetDeg * _steps_per_rev / 360.0);
-    double speed = speedDeg * (double)_steps_per_rev / 360.0;
-    double acceleration = accelerationDeg * (double)_steps_per_rev / 360.0;
+    _snapshotSequence = _snapshotSequence + 1;
+    STEPPER_MEMORY_BARRIER();
+    _snapshot.position = _position;
+    _snapshot.target = _targetPos;
+    _snapshot.speed = _curSpeed;
+    _snapshot.moving = isRunning();
+    STEPPER_MEMORY_BARRIER();
+    _snapshotSequence = _snapshotSequence + 1;
+}
 
-    enterCritical();
+void StepperCore::readSnapshot(StepperSnapshot& snapshot)
+{
+    StepperSequence sequence;
+    do {
+        sequence = _snapshotSequence;
+        STEPPER_MEMORY_BARRIER();
+        snapshot = _snapshot;
+        STEPPER_MEMORY_BARRIER();
+    } while ((sequence & 1) || sequence != _snapshotSequence);
+}
+
+double StepperCore::speedStepsPerSec(double rawSpeed)
+{
+#if defined(STEPPER_STEP_SCHEDULING)
+    return rawSpeed == 0 ? 0.0 : 256e6 / rawSpeed;
+#else
+    return rawSpeed * _speedScale;
+#endif
+}
+
+// Positions of modulo motors are renormalized into one revolution whenever
+// they stop, so they are rarely far outside of it.
+long StepperCore::wrapPosition(long position)
+{
+    return wrapRevolution(position, _steps_per_rev);
+}
 
-    if (speed < 0) speed = -speed;
+double StepperCore::clampSpeed(double speedDeg)
+{
+    double speed = fabs(speedDeg * _stepsPerDegree);
     if (speed < _vmaxMin) speed = _vmaxMin;
     if (speed > _vmaxMax) speed = _vmaxMax;
-    _vmax = speed;
+    return speed;
+}
 
-    if (acceleration < 0) acceleration = -acceleration;
+double StepperCore::clampAcceleration(double accelerationDeg)
+{
+    double acceleration = fabs(accelerationDeg * _stepsPerDegree);
     if (acceleration < _accelMin) acceleration = _accelMin;
     if (acceleration > _accelMax) acceleration = _accelMax;
-    if (_accel != acceleration && !isRunning()) _accel = acceleration;
-
-    if (modulo) {
-        target %= _steps_per_rev;
-        if (target < 0) target += _steps_per_rev;
-
-        long positionModulo = _position % _steps_per_rev;
-        if (positionModulo < 0) positionModulo += _steps_per_rev;
-        long clockwiseDistance = target - positionModulo;
-        if (clockwiseDistance < 0) clockwiseDistance += _steps_per_rev;
-        long counterClockwiseDistance = positionModulo - target;
-        if (counterClockwiseDistance < 0) counterClockwiseDistance += _steps_per_rev;
-
-        long finalTarget = _position;
-        if (mode == ROT_CW) finalTarget += clockwiseDistance;
-        else if (mode == ROT_CCW) finalTarget -= counterClockwiseDistance;
-        else if (clockwiseDistance <= counterClockwiseDistance)
-            finalTarget += clockwiseDistance;
-        else
-            finalTarget -= counterClockwiseDistance;
-        target = finalTarget;
-    } else {
+    return acceleration;
+}
+
+long StepperCore::resolveTarget(double targetDeg, RotaryMode mode, bool modulo,
+                                long from)
+{
+    long target = (long)round(targetDeg * _stepsPerDegree);
+
+    if (!modulo) {
         if (target > _maxPos) target = _maxPos;
         if (target < _minPos) target = _minPos;
+        return target;
+    }
+
+    target = wrapPosition(target);
+    long fromModulo = wrapPosition(from);
+    long clockwiseDistance = target - fromModulo;
+    if (clockwiseDistance < 0) clockwiseDistance += _steps_per_rev;
+    long counterClockwiseDistance = fromModulo - target;
+    if (counterClockwiseDistance < 0) counterClockwiseDistance += _steps_per_rev;
+
+    if (mode == ROT_CW) return from + clockwiseDistance;
+    if (mode == ROT_CCW) return from - counterClockwiseDistance;
+    if (clockwiseDistance <= counterClockwiseDistance)
+        return from + clockwiseDistance;
+    return from - counterClockwiseDistance;
+}
+
+void StepperCore::applyCommandDegrees(double targetDeg, double speedDeg,
+                                      double accelerationDeg, RotaryMode mode,
+                                      bool modulo)
+{
+    applyClampedCommand(targetDeg, clampSpeed(speedDeg),
+                      clampAcceleration(accelerationDeg), mode, modulo);
+}
+
+double StepperCore::moveDurationDegrees(double targetDeg, double speedDeg,
+                                        double accelerationDeg,
+                                        RotaryMode mode, bool modulo)
+{
+    StepperSnapshot snapshot;
+    readSnapshot(snapshot);
+    long position = snapshot.position;
+
+    long target = resolveTarget(targetDeg, mode, modulo, position);
+    return trapezoidDuration(fabs((double)(target - position)),
+                             clampSpeed(speedDeg),
+                             clampAcceleration(accelerationDeg));
+}
+
+void StepperCore::applyCoordinatedDegrees(double targetDeg, double speedDeg,
+                                          double accelerationDeg,
+                                          RotaryMode mode, bool modulo,
+                                          double duration)
+{
+    StepperSnapshot snapshot;
+    readSnapshot(snapshot);
+    long position = snapshot.position;
+
+    double distance =
+        fabs((double)(resolveTarget(targetDeg, mode, modulo, position) - position));
+    double speed = clampSpeed(speedDeg);
+    double acceleration = clampAcceleration(accelerationDeg);
+    double ownDuration = trapezoidDuration(distance, speed, acceleration);
+
+    if (duration > ownDuration && ownDuration > 0.0) {
+        // Stretching by k scales the acceleration by k^2. If that falls
+        // below the minimum, the minimum is kept and the cruise speed is
+        // solved from d / v + v / a = T instead.
+        double scale = ownDuration / duration;
+        acceleration *= scale * scale;
+        if (acceleration < _accelMin) acceleration = _accelMin;
+
+        double reach = acceleration * duration;
+        double discriminant = reach * reach - 4.0 * acceleration * distance;
+        if (discriminant > 0.0) speed = (reach - sqrt(discriminant)) / 2.0;
+        if (speed < _vmaxMin) speed = _vmaxMin;
+    }
+
+    applyClampedCommand(targetDeg, speed, acceleration, mode, modulo);
+}
+
+void StepperCore::applyClampedCommand(double targetDeg, double speed,
+                                    double acceleration, RotaryMode mode,
+                                    bool modulo)
+{
+    flushSegments();
+
+    enterCritical();
+    long position = _position;
+    double currentSpeed = _curSpeed;
+    // What the interrupt follows until it takes the new plan; a plan still
+    // pending is replaced. Its acceleration may be above _accel after an
+    // earlier change.
+    long stopTarget = _targetPos;
+    double previousAccel = _plans[_activePlan].accel;
+#if defined(STEPPER_STEP_SCHEDULING)
+    double currentAccel = 0.0;
+#else
+    double currentAccel = _curAccel;
+#endif
+    leaveCritical();
+
+    _vmax = speed;
+    _accel = acceleration;
+
+    long target = resolveTarget(targetDeg, mode, modulo, position);
+    bool retarget = target != _plannedTarget || _halting;
+    _plannedTarget = target;
+    _halting = false;
+
+    // A motor moving away from the target, or towards it but too fast to
+    // stop on it, brakes to a stop first: the next leg then starts at rest
+    // from the predicted stopping point. The step of margin is what the
+    // braking curve itself may run past on the last step.
+    //
+    // A lower acceleration takes effect on the move under way too. Where
+    // the motor could then no longer stop in time (on the new target, or
+    // when moving away from it before the target the interrupt stops at),
+    // the plan keeps just enough acceleration to, and never more than it
+    // had; the new value applies in full from the next command.
+    double startSpeed = fabs(speedStepsPerSec(currentSpeed));
+    double risingAccel = speedStepsPerSec(currentAccel) / _timerPeriod;
+    double legStart = position;
+    long direction = target - position;
+    double planAccel = acceleration;
+    bool brakeFirst = false;
+    if (currentSpeed != 0) {
+        bool movingAway = (currentSpeed > 0 && direction < 0) ||
+                          (currentSpeed < 0 && direction > 0);
+        long room = labs(direction);
+        if (movingAway) {
+            long ahead = stopTarget - position;
+            room = (currentSpeed > 0) == (ahead > 0) ? labs(ahead) : 0;
+        }
+
+        if (acceleration < previousAccel &&
+            stopDistance(startSpeed, acceleration, risingAccel) > room + 1) {
+            planAccel = startSpeed * startSpeed / (2.0 * (room > 0 ? room : 1));
+            if (planAccel < acceleration) planAccel = acceleration;
+            if (planAccel > previousAccel ||
+                stopDistance(startSpeed, planAccel, risingAccel) > room + 1)
+                planAccel = previousAccel;
+        }
+
+        brakeFirst = movingAway ||
+                     stopDistance(startSpeed, planAccel, risingAccel) > room + 1;
+        if (brakeFirst) {
+            double stopSteps = stopDistance(startSpeed, planAccel, risingAccel);
+            legStart += currentSpeed > 0 ? stopSteps : -stopSteps;
+            startSpeed = 0.0;
+        }
+    }
+    _plannedDirection = target > legStart ? 1 : (target < legStart ? -1 : 0);
+
+    publishPlan(target, retarget || brakeFirst, brakeFirst, planAccel, startSpeed,
+                (long)fabs(target - legStart));
+}
+
+// With a jerk limit, an acceleration still raising the speed is released
+// first, as the interrupt does: that takes t = a0 / j (plus the tick that
+// notices it), gains a0 * t / 2 and covers up to v1 * t. The jerk is
+// raised as in fillPlan().
+double StepperCore::stopDistance(double speed, double acceleration,
+                                 double rising)
+{
+    if (_jerk <= 0.0) return speed * speed / (2.0 * acceleration);
+
+    double jerk = _jerk;
+    double minJerk = acceleration * acceleration * _timerPeriod;
+    if (jerk < minJerk) jerk = minJerk;
+
+    double steps = 0.0;
+    if (rising > acceleration) rising = acceleration;
+    if (rising > 0.0) {
+        double release = rising / jerk + _timerPeriod;
+        speed += rising * release / 2.0;
+        steps = speed * release;
+    }
+    return steps + speed * speed / (2.0 * acceleration) +
+           speed * acceleration / (2.0 * jerk);
+}
+
+bool StepperCore::enqueueCommandDegrees(double targetDeg, double speedDeg,
+                                        double accelerationDeg, RotaryMode mode,
+                                        bool modulo)
+{
+    if (_segmentCount >= STEPPER_SEGMENT_QUEUE_SIZE) return false;
+
+    long from = _plannedTarget;
+    if (_segmentCount > 0) {
+        uint8_t last = (_segmentHead + _segmentCount - 1) % STEPPER_SEGMENT_QUEUE_SIZE;
+        from = _segments[last].target;
+    }
+
+    StepperSegment& segment =
+        _segments[(_segmentHead + _segmentCount) % STEPPER_SEGMENT_QUEUE_SIZE];
+    segment.target = resolveTarget(targetDeg, mode, modulo, from);
+    segment.speed = clampSpeed(speedDeg);
+    segment.acceleration = clampAcceleration(accelerationDeg);
+    ++_segmentCount;
+    return true;
+}
+
+void StepperCore::flushSegments()
+{
+    _segmentCount = 0;
+
+    enterCritical();
+    bool staged = _segmentReady;
+    _segmentReady = false;
+    leaveCritical();
+
+    // The staged segment never started: the motor finishes the move before
+    // it, so the planner goes back to that one.
+    if (staged) {
+        _plannedTarget = _segmentBefore.target;
+        _vmax = _segmentBefore.speed;
+        _accel = _segmentBefore.acceleration;
+        _plannedDirection = _directionBefore;
+    }
+}
+
+uint8_t StepperCore::queuedSegments()
+{
+    return _segmentCount + (_segmentReady ? 1 : 0);
+}
+
+bool StepperCore::setJerkDegrees(double jerkDeg)
+{
+    double jerk = fabs(jerkDeg * _stepsPerDegree);
+#if defined(STEPPER_STEP_SCHEDULING)
+    return jerk == 0.0;
+#else
+    double maxJerk = _accelMax / _timerPeriod;
+    if (jerk > maxJerk) jerk = maxJerk;
+    _jerk = jerk;
+    return true;
+#endif
+}
+
+bool StepperCore::setEmergencyDecelDegrees(double decelerationDeg)
+{
+    if (decelerationDeg < 0.0) return false;
+
+    double deceleration = decelerationDeg * _stepsPerDegree;
+    if (deceleration > 0.0 && deceleration < _accelMin) deceleration = _accelMin;
+    if (deceleration > _accelMax) deceleration = _accelMax;
+    _emergencyDecel = deceleration;
+    return true;
+}
+
+void StepperCore::emergencyStop()
+{
+    flushSegments();
+
+    enterCritical();
+    long position = _position;
+    double currentSpeed = _curSpeed;
+    leaveCritical();
+
+    double deceleration = _emergencyDecel > 0.0 ? _emergencyDecel : _accelMax;
+    if (deceleration < _accel) deceleration = _accel;
+
+    // Predicted stopping point, so that commands queued behind the stop
+    // resolve from about where the motor will be.
+    double speed = fabs(speedStepsPerSec(currentSpeed));
+    long stopSteps = (long)ceil(speed * speed / (2.0 * deceleration));
+    if (currentSpeed > 0) _plannedTarget = position + stopSteps;
+    else if (currentSpeed < 0) _plannedTarget = position - stopSteps;
+    else _plannedTarget = position;
+    _plannedDirection = 0;
+    _halting = true;
+
+    _planPending = false;
+    compilerBarrier();
+
+    StepperPlan& plan = _plans[_activePlan ^ 1];
+    plan.retarget = true;
+    plan.target = _plannedTarget;
+    plan.brakeFirst = false;
+    plan.halt = true;
+    plan.continues = false;
+    fillPlan(plan, deceleration, 0.0, 0);
+#if !defined(STEPPER_STEP_SCHEDULING)
+    plan.jerk = 0;
+#endif
+
+    compilerBarrier();
+    _planPending = true;
+}
+
+void StepperCore::serviceSegments()
+{
+    if (_halting && !_planPending) {
+        enterCritical();
+        bool stopped = !isRunning();
+        long target = _targetPos;
+        leaveCritical();
+        if (stopped) {
+            _plannedTarget = target;
+            _halting = false;
+        }
+    }
+
+    if (_segmentReady || _segmentCount == 0) return;
+
+    const StepperSegment& segment = _segments[_segmentHead];
+    long offset = segment.target - _plannedTarget;
+    int8_t direction = offset > 0 ? 1 : (offset < 0 ? -1 : 0);
+    long distance = offset >= 0 ? offset : -offset;
+
+    // Fastest entry from which the segment can still stop at its end, and
+    // the junction speed shared with the segment before it.
+    double entrySpeed = sqrt(2.0 * segment.acceleration * distance);
+    if (entrySpeed > segment.speed) entrySpeed = segment.speed;
+    bool continues = direction != 0 && direction == _plannedDirection;
+    double junctionSpeed = 0.0;
+    if (continues) junctionSpeed = entrySpeed < _vmax ? entrySpeed : _vmax;
+
+    StepperPlan& plan = _segmentPlan;
+    plan.target = segment.target;
+    plan.retarget = true;
+    plan.brakeFirst = false;
+    plan.halt = false;
+    plan.continues = continues;
+#if defined(STEPPER_STEP_SCHEDULING)
+    plan.junctionRamp = (long)(junctionSpeed * junctionSpeed / (2.0 * _accel));
+    plan.entryRamp =
+        (long)(junctionSpeed * junctionSpeed / (2.0 * segment.acceleration));
+#else
+    plan.junctionSpeed = toTick(junctionSpeed * _timerPeriod);
+#endif
+
+    _segmentBefore.target = _plannedTarget;
+    _segmentBefore.speed = _vmax;
+    _segmentBefore.acceleration = _accel;
+    _directionBefore = _plannedDirection;
+
+    _vmax = segment.speed;
+    _accel = segment.acceleration;
+    fillPlan(plan, _accel, junctionSpeed, distance);
+    _plannedTarget = segment.target;
+    if (direction != 0) _plannedDirection = direction;
+
+    _segmentHead = (_segmentHead + 1) % STEPPER_SEGMENT_QUEUE_SIZE;
+    --_segmentCount;
+
+    compilerBarrier();
+    _segmentReady = true;
+}
+
+void StepperCore::publishPlan(long target, bool retarget, bool brakeFirst,
+                              double acceleration, double startSpeed,
+                              long distance)
+{
+    bool replacing = _planPending;
+    _planPending = false;
+    compilerBarrier();
+
+    // A plan the interrupt has not picked up yet may still carry a new
+    // target, which must survive being replaced.
+    StepperPlan& plan = _plans[_activePlan ^ 1];
+    plan.retarget = retarget || (replacing && plan.retarget);
+    plan.target = target;
+    plan.brakeFirst = brakeFirst;
+    plan.halt = false;
+    plan.continues = false;
+    fillPlan(plan, acceleration, startSpeed, distance);
+
+    compilerBarrier();
+    _planPending = true;
+}
+
+void StepperCore::fillPlan(StepperPlan& plan, double acceleration,
+                           double startSpeed, long distance)
+{
+    plan.accel = acceleration;
+#if defined(STEPPER_STEP_SCHEDULING)
+    (void)startSpeed;
+    (void)distance;
+    plan.minInterval = toIntervalQ8(1.0 / _vmax);
+    plan.firstInterval = firstIntervalQ8(acceleration, plan.minInterval);
+
+    // Ratio to the plan in use, which the interrupt keeps until it takes
+    // this one.
+    double ratio = _plans[_activePlan].accel / acceleration;
+    plan.rampScale = ratio < 255.0 ? (uint16_t)(ratio * 256.0 + 0.5) : 65535;
+#else
+    // Cruise at vmax, or at the peak of a triangular profile when the leg
+    // is too short to reach it. Braking only has to be checked once the
+    // remaining distance falls inside the braking distance of the fastest
+    // speed of the leg; two steps of margin cover the speed gained before
+    // the interrupt picks the plan up.
+    double peakSpeed = sqrt(startSpeed * startSpeed / 2.0 + acceleration * distance);
+    double cruiseSpeed = _vmax < peakSpeed ? _vmax : peakSpeed;
+    double windowSpeed = startSpeed > cruiseSpeed ? startSpeed : cruiseSpeed;
+
+    plan.cruiseSpeed = toTick(cruiseSpeed * _timerPeriod);
+    plan.acceleration = toTick(acceleration * _timerPeriod * _timerPeriod);
+    double brakeSteps = windowSpeed * windowSpeed / (2.0 * acceleration);
+
+    // With a jerk limit the braking distance grows by v * a / 2j, plus up
+    // to v * a / j travelled while a running acceleration is released. The
+    // limit is raised if needed so that a^2 / j stays below one step per
+    // tick, which keeps the interrupt arithmetic in range.
+    plan.jerk = 0;
+    plan.jerkSpeed = 0;
+    plan.inverseJerk = 0;
+    if (_jerk > 0.0) {
+        double jerk = _jerk;
+        double minJerk = acceleration * acceleration * _timerPeriod;
+        if (jerk < minJerk) jerk = minJerk;
+        double jerkTick = jerk * _timerPeriod * _timerPeriod * _timerPeriod;
+        plan.jerk = toTick(jerkTick);
+        if (plan.jerk == 0) plan.jerk = 1;
+        plan.jerkSpeed = toTick(acceleration * acceleration / jerk * _timerPeriod);
+#if defined(STEPPER_FIXED_POINT)
+        plan.inverseJerk = (StepperTickSquare)(STEPPER_Q30_ONE / (double)plan.jerk);
+#else
+        plan.inverseJerk = 1.0 / jerkTick;
+#endif
+        brakeSteps += 1.5 * windowSpeed * acceleration / jerk;
     }
+    plan.arrivalSpeed = toTick(sqrt(acceleration) * _timerPeriod);
+    plan.brakeWindow = (long)brakeSteps + 2;
+#endif
+}
+
+void StepperCore::adoptPlan()
+{
+    if (!_planPending) return;
 
-    if (target != _targetPos) {
-        long currentDirection = _targetPos - _position;
-        long newDirection = target - _position;
-        if (isRunning() && currentDirection * newDirection < 0) {
+    _activePlan ^= 1;
+    _planPending = false;
+
+    const StepperPlan& plan = _plans[_activePlan];
+#if defined(STEPPER_STEP_SCHEDULING)
+    if (plan.rampScale != 256 && _accSteps != 0)
+        _accSteps = (long)(((int64_t)_accSteps * plan.rampScale) >> 8);
+#endif
+    if (!plan.retarget) return;
+
+    _haltBraking = false;
+    if (plan.halt) {
+        if (_curSpeed != 0) {
             _reversing = true;
-            _targetDuringReverse = target;
+            _haltBraking = true;
         } else {
-            _targetPos = target;
+            _targetPos = _position;
             _reversing = false;
         }
+        return;
     }
 
-    leaveCritical();
+    bool movingAway = (_curSpeed > 0 && plan.target < _position) ||
+                      (_curSpeed < 0 && plan.target > _position);
+    if (movingAway || (plan.brakeFirst && _curSpeed != 0)) {
+        _reversing = true;
+        _targetDuringReverse = plan.target;
+    } else {
+        _targetPos = plan.target;
+        _reversing = false;
+    }
+}
+
+void StepperCore::adoptSegment()
+{
+#if defined(STEPPER_STEP_SCHEDULING)
+    // Carry the ramp index over to the acceleration of the new segment.
+    const StepperPlan& plan = _segmentPlan;
+    long ramp = _accSteps >= 0 ? _accSteps : -_accSteps;
+    if (ramp >= plan.junctionRamp) ramp = plan.entryRamp;
+    else if (plan.junctionRamp > 0) ramp = ramp * plan.entryRamp / plan.junctionRamp;
+    _accSteps = ramp;
+#endif
+    _plans[_activePlan] = _segmentPlan;
+    _targetPos = _segmentPlan.target;
+    _segmentReady = false;
 }
 
 void StepperCore::configureMotion(double timerPeriodSec, long stepsPerRev,
@@ -93,82 +646,410 @@ void StepperCore::configureMotion(double timerPeriodSec, long stepsPerRev,
     _steps_per_rev = stepsPerRev;
     _minPos = minPos;
     _maxPos = maxPos;
-    homePosition();
 
     _timerPeriod = timerPeriodSec;
+    _degreesPerStep = 360.0 / (double)stepsPerRev;
+    _stepsPerDegree = (double)stepsPerRev / 360.0;
+#if !defined(STEPPER_STEP_SCHEDULING)
+    _speedScale = 1.0 / (STEPPER_TICK_ONE * _timerPeriod);
+#endif
+#if defined(STEPPER_TWO_PHASE_PULSE)
+    _vmaxMax = 0.5 / _timerPeriod;
+#else
     _vmaxMax = 1.0 / _timerPeriod;
+#endif
     _accelMax = _vmaxMax / _timerPeriod;
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+    _probe.calibrate();
+    _probe.setPeriod(_timerPeriod);
+#endif
+
+    if (_vmax > _vmaxMax) _vmax = _vmaxMax;
+    if (_accel > _accelMax) _accel = _accelMax;
+    if (_jerk > _accelMax / _timerPeriod) _jerk = _accelMax / _timerPeriod;
+    if (_emergencyDecel > _accelMax) _emergencyDecel = _accelMax;
+    publishPlan(_plannedTarget, false, false, _accel, 0.0, 0);
 }
 
+bool StepperCore::reconfigure(long stepsPerRev, long minPos, long maxPos,
+                              double timerPeriodSec)
+{
+    if (!canReconfigure(timerPeriodSec)) return false;
+
+    configureMotion(timerPeriodSec, stepsPerRev, minPos, maxPos);
+    return true;
+}
+
+bool StepperCore::canReconfigure(double timerPeriodSec)
+{
+    StepperState state;
+    readState(state);
+    if (state.running) return false;
+#if defined(STEPPER_TWO_PHASE_PULSE)
+    if (timerPeriodSec * 1e6 < STEPPER_PULSE_WIDTH_US) return false;
+#else
+    (void)timerPeriodSec;
+#endif
+    return true;
+}
+
+#if defined(STEPPER_STEP_SCHEDULING)
+uint32_t StepperCore::RunStepISR()
+{
+    ISR_PROBE_BEGIN(_probe);
+    uint32_t interval = advanceStep();
+    publishSnapshot();
+    ISR_PROBE_PERIOD_US(_probe, interval);
+    ISR_PROBE_END(_probe);
+    return interval;
+}
+
+uint32_t StepperCore::advanceStep()
+{
+    adoptPlan();
+    if (_segmentReady && !_reversing && _curSpeed == 0 && _position == _targetPos)
+        adoptSegment();
+    const StepperPlan& plan = _plans[_activePlan];
+
+    int32_t interval = _curSpeed;
+    if (interval != 0) {
+        int direction = interval > 0 ? 1 : -1;
+        emitStep(direction);
+        _position += direction;
+        if (_position == _targetPos && !_reversing && segmentContinues())
+            adoptSegment();
+    }
+
+    long dist = _targetPos - _position;
+
+    if (interval == 0) {
+        if (_reversing) {
+            _targetPos = _haltBraking ? (long)_position : _targetDuringReverse;
+            _reversing = false;
+            _haltBraking = false;
+            dist = _targetPos - _position;
+        }
+        if (dist == 0) return STEPPER_IDLE_INTERVAL_US;
+
+        _accSteps = 0;
+        _curSpeed = dist > 0 ? (int32_t)plan.firstInterval
+                             : -(int32_t)plan.firstInterval;
+        return plan.firstInterval >> 8;
+    }
+
+    int direction = interval > 0 ? 1 : -1;
+    uint32_t magnitude = interval > 0 ? interval : -interval;
+    long remaining = direction > 0 ? dist : -dist;
+    long ramp = _accSteps;
+    long stepsToStop = ramp >= 0 ? ramp : -ramp;
+
+    if (remaining <= 0) {
+        _curSpeed = 0;
+        _accSteps = 0;
+        return STEPPER_IDLE_INTERVAL_US;
+    }
+
+    long junctionRamp = segmentContinues() ? _segmentPlan.junctionRamp : 0;
+    if (_reversing || remaining <= stepsToStop - junctionRamp) {
+        if (ramp > 0) ramp = -ramp;
+        if (ramp == 0) {
+            _curSpeed = 0;
+            _accSteps = 0;
+            return STEPPER_IDLE_INTERVAL_US;
+        }
+        magnitude += (2 * magnitude) / (uint32_t)(-4 * ramp - 1);
+        ++ramp;
+    } else {
+        if (ramp < 0) ramp = -ramp;
+        if (magnitude < plan.minInterval) {
+            // Above a lowered vmax: brake along the ramp down to it.
+            magnitude += (2 * magnitude) / (uint32_t)(ramp > 0 ? 4 * ramp - 1 : 1);
+            if (ramp > 0) --ramp;
+            if (magnitude > plan.minInterval) magnitude = plan.minInterval;
+        } else if (magnitude > plan.minInterval) {
+            ++ramp;
+            magnitude -= (2 * magnitude) / (uint32_t)(4 * ramp + 1);
+            if (magnitude < plan.minInterval) magnitude = plan.minInterval;
+        }
+    }
+
+    _accSteps = ramp;
+    _curSpeed = direction > 0 ? (int32_t)magnitude : -(int32_t)magnitude;
+    return magnitude >> 8;
+}
+#else
 void StepperCore::RunISR()
 {
+    ISR_PROBE_BEGIN(_probe);
+#if defined(STEPPER_TWO_PHASE_PULSE)
+    if (_pulseHigh) digitalWriteFast(_stepPin, LOW);
+#endif
+    int8_t direction = advanceTick();
+    if (direction != 0) emitStep(direction);
+    ISR_PROBE_END(_probe);
+}
+
+int8_t StepperCore::advanceTick()
+{
+    int8_t direction = advanceMotion();
+    publishSnapshot();
+    return direction;
+}
+
+int8_t StepperCore::advanceMotion()
+{
+#if defined(STEPPER_TWO_PHASE_PULSE)
+    bool pulseHigh = _pulseHigh;
+    _pulseHigh = false;
+#endif
+    adoptPlan();
+    if (_segmentReady && !_reversing && _curSpeed == 0 && _position == _targetPos)
+        adoptSegment();
+    const StepperPlan& plan = _plans[_activePlan];
+
     long dist = _targetPos - _position;
-    double distance = dist >= 0 ? dist : -dist;
+    long distance = dist >= 0 ? dist : -dist;
+    StepperTick speed = _curSpeed;
 
-    if (_reversing && fabs(_curSpeed) < 1e-6) {
-        _curSpeed = 0.0;
+    if (_reversing && speed == 0) {
         _accSteps = 0;
-        _targetPos = _targetDuringReverse;
+        _curAccel = 0;
+        _targetPos = _haltBraking ? (long)_position : _targetDuringReverse;
         _reversing = false;
-        return;
+        _haltBraking = false;
+        return 0;
     }
 
-    if (dist == 0 && fabs(_curSpeed) < 1e-6) {
-        _curSpeed = 0.0;
-        _accSteps = 0.0;
-        return;
+    if (dist == 0 && speed == 0) {
+        _accSteps = 0;
+        _curAccel = 0;
+        return 0;
     }
 
-    int direction = dist >= 0 ? 1 : -1;
-    double peakSpeed = sqrt(2.0 * _accel * distance);
-    double targetSpeed = _vmax < peakSpeed ? _vmax : peakSpeed;
+    StepperTick magnitude = speed >= 0 ? speed : -speed;
+    bool tracking = true;
 
-    if (_reversing) targetSpeed = 0.0;
+    if (plan.jerk != 0) {
+        magnitude = jerkLimitedSpeed(plan, magnitude, distance);
+        tracking = false;
+    } else if (_reversing) {
+        magnitude -= plan.acceleration;
+        if (magnitude < 0) magnitude = 0;
+        tracking = false;
+    } else if (distance <= plan.brakeWindow) {
+        // Braking curve v = sqrt(2 * a * d), compared squared: v^2 > 2ad
+        // means brake now, (v + a)^2 > 2ad means one more increment would
+        // cross it, so the speed is held. A continuing segment raises the
+        // curve by the junction speed: v^2 = vj^2 + 2ad.
+        StepperTickSquare peakSquared =
+            2 * (StepperTickSquare)plan.acceleration * distance;
+        if (segmentContinues())
+            peakSquared += tickSquare(_segmentPlan.junctionSpeed);
 
-    if (fabs(_curSpeed) < targetSpeed) {
-        _curSpeed += direction * _accel * _timerPeriod;
-        if (fabs(_curSpeed) > targetSpeed) _curSpeed = direction * targetSpeed;
-    } else if (fabs(_curSpeed) > targetSpeed) {
-        _curSpeed -= direction * _accel * _timerPeriod;
-        if (fabs(_curSpeed) < targetSpeed) _curSpeed = direction * targetSpeed;
+        // In fixed point a crawl squares to 0; on the target it still brakes.
+        if (tickSquare(magnitude) > peakSquared ||
+            (peakSquared == 0 && magnitude > 0)) {
+            magnitude -= plan.acceleration;
+            if (magnitude < 0) magnitude = 0;
+            tracking = false;
+        } else if (magnitude <= plan.cruiseSpeed &&
+                   tickSquare((StepperTickSquare)magnitude + plan.acceleration) >
+                       peakSquared) {
+            tracking = false;
+        }
     }
 
-    _accSteps += _curSpeed * _timerPeriod;
+    if (tracking) {
+        if (magnitude < plan.cruiseSpeed) {
+            magnitude += plan.acceleration;
+            if (magnitude > plan.cruiseSpeed) magnitude = plan.cruiseSpeed;
+        } else if (magnitude > plan.cruiseSpeed) {
+            magnitude -= plan.acceleration;
+            if (magnitude < plan.cruiseSpeed) magnitude = plan.cruiseSpeed;
+        }
+    }
 
-    if (_accSteps >= 1.0 || _accSteps <= -1.0) {
-        int stepDirection = _accSteps > 0 ? 1 : -1;
-        long nextPosition = _position + stepDirection;
-        bool reachedOrPast = (stepDirection > 0 && nextPosition >= _targetPos) ||
-                             (stepDirection < 0 && nextPosition <= _targetPos);
+    // On the target a moving motor keeps its direction while it brakes.
+    speed = dist > 0 || (dist == 0 && speed > 0) ? magnitude : -magnitude;
+    _curSpeed = speed;
+    StepperTick accSteps = _accSteps + speed;
+    _accSteps = accSteps;
 
-        if (_reversing && reachedOrPast) {
-            _accSteps = 0.0;
-            _curSpeed = 0.0;
-        } else if (!_reversing &&
-                   (stepDirection > 0 ? nextPosition > _targetPos
-                                      : nextPosition < _targetPos)) {
-            _position = _targetPos;
-            _accSteps = 0.0;
-            _curSpeed = 0.0;
-        } else {
-            emitStep(stepDirection);
-            _position = nextPosition;
-            _accSteps -= stepDirection;
-
-            if (!_reversing && reachedOrPast) {
-                _accSteps = 0.0;
-                _curSpeed = 0.0;
-            }
+    if (accSteps < STEPPER_TICK_ONE && accSteps > -STEPPER_TICK_ONE) return 0;
+#if defined(STEPPER_TWO_PHASE_PULSE)
+    // The last pulse only ends in this period; a step due right behind it,
+    // e.g. after an S-curve overshoot of vmax, waits for the next one.
+    if (pulseHigh) return 0;
+#endif
+
+    int8_t stepDirection = accSteps > 0 ? 1 : -1;
+    long nextPosition = _position + stepDirection;
+    bool reachedOrPast = (stepDirection > 0 && nextPosition >= _targetPos) ||
+                         (stepDirection < 0 && nextPosition <= _targetPos);
+
+    bool continuing = !_reversing && reachedOrPast && segmentContinues();
+
+    if (_reversing && reachedOrPast) {
+        _accSteps = 0;
+        _curSpeed = 0;
+        _curAccel = 0;
+        return 0;
+    }
+
+    if (!_reversing && !continuing &&
+        (stepDirection > 0 ? nextPosition > _targetPos
+                           : nextPosition < _targetPos)) {
+        _position = _targetPos;
+        _accSteps = 0;
+        _curSpeed = 0;
+        _curAccel = 0;
+        return 0;
+    }
+
+    _position = nextPosition;
+    _accSteps = stepDirection > 0 ? accSteps - STEPPER_TICK_ONE
+                                  : accSteps + STEPPER_TICK_ONE;
+
+    if (continuing) {
+        adoptSegment();
+    } else if (!_reversing && reachedOrPast) {
+        _accSteps = 0;
+        _curSpeed = 0;
+        _curAccel = 0;
+    }
+#if defined(STEPPER_TWO_PHASE_PULSE)
+    _pulseHigh = true;
+#endif
+    return stepDirection;
+}
+
+// S-curve speed update. The acceleration follows a command (full braking
+// on the braking curve, otherwise towards the cruise speed) but changes by
+// at most the jerk per tick. A reversal brakes to its end. Braking for a
+// target is decided again every tick, so a brake started early eases off
+// until the motor is back on the curve; the curve ends at the junction
+// speed of a continuing segment, or at the arrival speed the last step
+// stops from.
+StepperTick StepperCore::jerkLimitedSpeed(const StepperPlan& plan,
+                                          StepperTick magnitude, long distance)
+{
+    // A plan with a lower acceleration bounds it at once.
+    StepperTick acceleration = _curAccel;
+    if (acceleration > plan.acceleration) acceleration = plan.acceleration;
+    if (acceleration < -plan.acceleration) acceleration = -plan.acceleration;
+    StepperTick junction = 0;
+    if (segmentContinues()) junction = _segmentPlan.junctionSpeed;
+    else if (!_reversing && distance > 0) junction = plan.arrivalSpeed;
+    bool braking = _reversing;
+
+    if (!_reversing && magnitude > junction && distance <= plan.brakeWindow) {
+        // Releasing a positive acceleration first takes t = a / j, raises
+        // the speed to v1 = v + a * t / 2 and covers at most v1 * t. From v1
+        // the distance down to vj is (v1^2 - vj^2) / 2a + (v1 + vj) * c / 2a
+        // with c = a^2 / j, compared as
+        // v1 * (v1 + c) > 2a * (d - v1 * t) + vj * (vj - c).
+        // In fixed point t is rounded up to whole ticks, so that braking
+        // never starts late, and the release distance stays in Q30 steps;
+        // a * t is about a^2 / j, below one step per tick, so 2a * v1 * t
+        // fits. The distance is also cut by the part of a step already
+        // accumulated and by the v1 of one tick: not braking now means
+        // braking a tick later at best.
+        StepperTickSquare peak = magnitude;
+        StepperTickSquare releaseTicks = 0;
+        if (acceleration > 0) {
+#if defined(STEPPER_FIXED_POINT)
+            releaseTicks =
+                (acceleration * plan.inverseJerk + STEPPER_Q30_ONE - 1) >> 30;
+#else
+            releaseTicks = acceleration * plan.inverseJerk;
+#endif
+            peak += acceleration * releaseTicks / 2;
         }
+        StepperTickSquare accumulated = _curSpeed >= 0 ? _accSteps : -_accSteps;
+        if (accumulated < 0) accumulated = 0;
+        StepperTickSquare releaseBrake = 2 * tickProduct(
+            plan.acceleration, (releaseTicks + 1) * peak + accumulated);
+
+        StepperTickSquare limit =
+            2 * (StepperTickSquare)plan.acceleration * distance - releaseBrake +
+            tickProduct(junction, (StepperTickSquare)junction - plan.jerkSpeed);
+        braking = tickProduct(peak, peak + plan.jerkSpeed) > limit;
     }
+
+    // Braking releases once ramping the deceleration back to zero covers
+    // the rest of the gap, a^2 / 2j, so that it ends on or below the
+    // junction speed rather than short of it.
+    StepperTick command = 0;
+    if (braking) {
+        StepperTick gap = magnitude - junction;
+        if (gap > 0 && 2 * (StepperTickSquare)plan.jerk * gap >
+                           (StepperTickSquare)acceleration * acceleration)
+            command = -plan.acceleration;
+    } else if (magnitude < plan.cruiseSpeed) {
+        command = jerkCommand(plan, acceleration, plan.cruiseSpeed - magnitude);
+    } else if (magnitude > plan.cruiseSpeed) {
+        command = -jerkCommand(plan, -acceleration, magnitude - plan.cruiseSpeed);
+    }
+
+    if (acceleration < command) {
+        acceleration += plan.jerk;
+        if (acceleration > command) acceleration = command;
+    } else if (acceleration > command) {
+        acceleration -= plan.jerk;
+        if (acceleration < command) acceleration = command;
+    }
+
+    // What a release still gains after the cruise speed dropped under way,
+    // or a rounding error, never takes the speed past the cruise speed.
+    StepperTick next = magnitude + acceleration;
+    if (acceleration > 0 && next > plan.cruiseSpeed) {
+        next = magnitude > plan.cruiseSpeed ? magnitude : plan.cruiseSpeed;
+        acceleration = 0;
+    } else if (!braking && acceleration < 0 && magnitude > plan.cruiseSpeed &&
+               next < plan.cruiseSpeed) {
+        next = plan.cruiseSpeed;
+        acceleration = 0;
+    }
+
+    magnitude = next;
+    if (magnitude <= 0) {
+        magnitude = 0;
+        acceleration = 0;
+    }
+    _curAccel = acceleration;
+    return magnitude;
+}
+
+// Acceleration to command towards a speed gap away, given the current
+// acceleration counted towards the gap. Ramping an acceleration a back to
+// zero gains (a - j) + (a - 2j) + ... = a(a - j) / 2j after the tick that
+// adds a, so raising it to a' now still levels off within the gap while
+// 2j * gap >= a'(a' + j). Otherwise it is held where that holds for the
+// current value, or released.
+StepperTick StepperCore::jerkCommand(const StepperPlan& plan,
+                                     StepperTick acceleration, StepperTick gap)
+{
+    StepperTickSquare raised = (StepperTickSquare)acceleration + plan.jerk;
+    if (raised > plan.acceleration) raised = plan.acceleration;
+    if (raised <= 0) return plan.acceleration;
+
+    StepperTickSquare room = 2 * (StepperTickSquare)plan.jerk * gap;
+    if (room >= raised * (raised + plan.jerk)) return plan.acceleration;
+    if (acceleration > 0 &&
+        room >= (StepperTickSquare)acceleration * (acceleration + plan.jerk))
+        return acceleration;
+    return 0;
 }
+#endif
 
 void StepperCore::emitStep(int direction)
 {
     digitalWriteFast(_dirPin, direction > 0 ? HIGH : LOW);
     digitalWriteFast(_stepPin, HIGH);
-    delayMicroseconds(1);
+#if !defined(STEPPER_TWO_PHASE_PULSE)
+    delayMicroseconds(STEPPER_PULSE_WIDTH_US);
     digitalWriteFast(_stepPin, LOW);
+#endif
 }
 
 void StepperCore::enterCritical()
@@ -191,17 +1072,16 @@ void StepperCore::leaveCritical()
 
 void StepperCore::renormalizePosition()
 {
-    if (!isRunning()) {
-        long positionModulo = _position % _steps_per_rev;
-        if (positionModulo < 0) positionModulo += _steps_per_rev;
-
-        long targetModulo = _targetPos % _steps_per_rev;
-        if (targetModulo < 0) targetModulo += _steps_per_rev;
+    if (!isRunning() && !_planPending && !_segmentReady && _segmentCount == 0) {
+        long positionModulo = wrapPosition(_position);
+        long targetModulo = wrapPosition(_targetPos);
 
         if (positionModulo != _position || targetModulo != _targetPos) {
             enterCritical();
             _position = positionModulo;
             _targetPos = targetModulo;
+            _plannedTarget = targetModulo;
+            publishSnapshot();
             leaveCritical();
         }
     }
@@ -209,13 +1089,15 @@ void StepperCore::renormalizePosition()
 
 bool StepperCore::homePosition()
 {
-    if (_curSpeed != 0.0 || _accSteps != 0.0) return false;
+    if (_curSpeed != 0 || _accSteps != 0) return false;
 
     enterCritical();
     _position = 0;
     _targetPos = 0;
-    _curSpeed = 0.0;
-    _accSteps = 0.0;
+    _plannedTarget = 0;
+    _curSpeed = 0;
+    _accSteps = 0;
+    publishSnapshot();
     leaveCritical();
     return true;
 }
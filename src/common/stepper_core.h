@@ -4,6 +4,7 @@
 #include <Arduino.h>
 #include <stdint.h>
 #include <math.h>
+#include "isr_diagnostics.h"
 
 #ifdef IRAM_ATTR
 #define STEPPER_IRAM_ATTR IRAM_ATTR
@@ -11,6 +12,46 @@
 #define STEPPER_IRAM_ATTR
 #endif
 
+// RunISR() works in timer ticks: speeds and the step accumulator are kept
+// in steps per tick and the acceleration in steps per tick^2. Define
+// STEPPER_FIXED_POINT to hold them as signed Q2.30 values instead of double.
+#if defined(STEPPER_FIXED_POINT)
+#define STEPPER_Q30_ONE (1L << 30)
+typedef int32_t StepperTick;
+typedef int64_t StepperTickSquare;
+#define STEPPER_TICK_ONE STEPPER_Q30_ONE
+#else
+typedef double StepperTick;
+typedef double StepperTickSquare;
+#define STEPPER_TICK_ONE 1.0
+#endif
+
+// Define STEPPER_STEP_SCHEDULING to fire the motor interrupt once per step
+// instead of every timer period. RunStepISR() emits the due step and returns
+// the delay in microseconds until the next call; the timer period passed to
+// Setup() becomes the shortest step interval. The ramp follows the integer
+// step-interval recurrence c(n) = c(n-1) - 2 * c(n-1) / (4 * n + 1), with
+// intervals kept in 1/256 us.
+#if defined(STEPPER_STEP_SCHEDULING)
+#if defined(STEPPER_FIXED_POINT)
+#error "STEPPER_STEP_SCHEDULING already uses an integer kernel, drop STEPPER_FIXED_POINT"
+#endif
+#define STEPPER_IDLE_INTERVAL_US 1000UL
+#endif
+
+// Minimum STEP high time of the driver. By default each step holds the
+// interrupt for it. Define STEPPER_TWO_PHASE_PULSE to raise STEP in one
+// timer period and lower it at the start of the next one instead: the
+// interrupt never waits, pulses last a full period and, to leave the same
+// low time, steps are at most every other period (half the top speed).
+#if !defined(STEPPER_PULSE_WIDTH_US)
+#define STEPPER_PULSE_WIDTH_US 1
+#endif
+
+#if defined(STEPPER_TWO_PHASE_PULSE) && defined(STEPPER_STEP_SCHEDULING)
+#error "STEPPER_TWO_PHASE_PULSE needs the tick kernel, drop STEPPER_STEP_SCHEDULING"
+#endif
+
 enum RotaryMode : uint8_t {
     ROT_SHORTEST,
     ROT_CW,
@@ -23,12 +64,93 @@ struct StepperState
     long positionModulo;
     long targetPosition;
     long stepsPerRev;
+    double degreesPerStep;
     double speed;
     double maxSpeed;
     double acceleration;
     bool running;
 };
 
+// Motion state published by the interrupt after every call for readers in
+// the main loop, under a sequence counter that is odd while it is written.
+// The counter is a single byte on AVR so that reading it is atomic.
+#if defined(ARDUINO_ARCH_AVR)
+typedef uint8_t StepperSequence;
+#define STEPPER_MEMORY_BARRIER() __asm__ __volatile__("" ::: "memory")
+#else
+typedef uint32_t StepperSequence;
+#define STEPPER_MEMORY_BARRIER() __sync_synchronize()
+#endif
+
+struct StepperSnapshot
+{
+    long position;
+    long target;
+#if defined(STEPPER_STEP_SCHEDULING)
+    int32_t speed;
+#else
+    StepperTick speed;
+#endif
+    bool moving;
+};
+
+#define STEPPER_SEGMENT_QUEUE_SIZE 8
+
+// Move prepared by applyCommandDegrees() for the interrupt. Everything that
+// needs a square root or a division is computed here once per command.
+//
+// A queued segment that continues in the direction of the previous one has
+// continues set: the interrupt brakes towards the junction speed instead of
+// to a stop and switches to the segment when it reaches the junction.
+struct StepperPlan
+{
+    long target;
+    bool retarget;
+    // The motor cannot stop on the target from its current speed: it
+    // brakes to a stop past it and comes back, as for a reversal.
+    bool brakeFirst;
+    // Emergency stop: brake at the plan's acceleration and stay where the
+    // motor comes to rest.
+    bool halt;
+    bool continues;
+    // Acceleration in steps/s^2, for the main loop.
+    double accel;
+#if defined(STEPPER_STEP_SCHEDULING)
+    // The ramp index is rescaled by rampScale / 256 on adoption: the ratio
+    // of the previous plan's acceleration to this one's, so that a move
+    // can change it under way.
+    uint16_t rampScale;
+    uint32_t minInterval;
+    uint32_t firstInterval;
+    // Ramp index of the junction speed under the previous and under this
+    // segment's acceleration.
+    long junctionRamp;
+    long entryRamp;
+#else
+    StepperTick cruiseSpeed;
+    StepperTick acceleration;
+    long brakeWindow;
+    StepperTick junctionSpeed;
+    // S-curve profile: jerk per tick^3 (0 for the trapezoid), the speed
+    // a^2 / j gained while the acceleration ramps between 0 and a, and
+    // 1 / jerk in ticks^3 per step (a plain integer in fixed point).
+    StepperTick jerk;
+    StepperTick jerkSpeed;
+    StepperTickSquare inverseJerk;
+    // Speed an S-curve brakes to for a target it stops on, sqrt(a): the
+    // last step stops from it as a trapezoid does from its braking curve.
+    StepperTick arrivalSpeed;
+#endif
+};
+
+// Queued move in steps, resolved against the end of the segment before it.
+struct StepperSegment
+{
+    long target;
+    double speed;
+    double acceleration;
+};
+
 class StepperCore
 {
     public:
@@ -42,44 +164,110 @@ class StepperCore
                      double accelerationDeg, RotaryMode mode,
                      bool modulo);
 
+        // Coordinated moves: moveDurationDegrees() is the time the command
+        // would take from rest; applyCoordinatedDegrees() stretches the
+        // profile in time (speed * k, acceleration * k^2) to last duration.
+        double moveDurationDegrees(double targetDeg, double speedDeg,
+                                   double accelerationDeg, RotaryMode mode,
+                                   bool modulo);
+        void applyCoordinatedDegrees(double targetDeg, double speedDeg,
+                                     double accelerationDeg, RotaryMode mode,
+                                     bool modulo, double duration);
+
+        // Jerk limit in degrees/s^3 for the next moves, 0 for the plain
+        // trapezoid. Not available with STEPPER_STEP_SCHEDULING.
+        bool setJerkDegrees(double jerkDeg);
+        double getJerkDeg()
+        {
+            return _jerk * _degreesPerStep;
+        }
+
+        bool enqueueCommandDegrees(double targetDeg, double speedDeg,
+                                   double accelerationDeg, RotaryMode mode,
+                                   bool modulo);
+        void flushSegments();
+        void serviceSegments();
+        uint8_t queuedSegments();
+        bool canEnqueue() { return _segmentCount < STEPPER_SEGMENT_QUEUE_SIZE; }
+
+        // Drops the queued segments and brakes to a stop at the emergency
+        // deceleration, or at the move's acceleration if that is higher.
+        // The motor stays where it stops until the next command.
+        void emergencyStop();
+        // Emergency deceleration in degrees/s^2, 0 for the maximum
+        // acceleration.
+        bool setEmergencyDecelDegrees(double decelerationDeg);
+        double getEmergencyDecelDeg()
+        {
+            return _emergencyDecel * _degreesPerStep;
+        }
+
+#if defined(STEPPER_STEP_SCHEDULING)
+        uint32_t STEPPER_IRAM_ATTR RunStepISR();
+#else
         void STEPPER_IRAM_ATTR RunISR();
+        // One timer period without touching the pins: returns the direction
+        // of the step to emit, or 0. RunISR() and StepperBank drive the pins.
+        int8_t STEPPER_IRAM_ATTR advanceTick();
+#endif
+
+        uint8_t getStepPin() { return _stepPin; }
+        uint8_t getDirPin() { return _dirPin; }
+
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+        // Times RunISR()/RunStepISR(), or advanceTick() inside a StepperBank.
+        IsrProbe& isrProbe() { return _probe; }
+#endif
 
         void renormalizePosition();
 
+        // Changes the gearing, limits and timer period of a stopped motor
+        // and rescales the speed and acceleration bounds. The position
+        // keeps its step count. Returns false while the motor moves; the
+        // caller reprograms the timer itself. canReconfigure() tells
+        // beforehand whether the call would succeed.
+        bool reconfigure(long stepsPerRev, long minPos, long maxPos,
+                         double timerPeriodSec);
+        bool canReconfigure(double timerPeriodSec);
+        long getStepsPerRev() { return _steps_per_rev; }
+        long getMinPosition() { return _minPos; }
+        long getMaxPosition() { return _maxPos; }
+        double getTimerPeriod() { return _timerPeriod; }
+
         double getMaxSpeedMax(void) { return _vmaxMax; }
         double getMaxSpeedDegMax()
         {
-            return _vmaxMax * 360.0 / (double)_steps_per_rev;
+            return _vmaxMax * _degreesPerStep;
         }
         double getMaxSpeedMin(void) { return _vmaxMin; }
         double getMaxSpeedDegMin()
         {
-            return _vmaxMin * 360.0 / (double)_steps_per_rev;
+            return _vmaxMin * _degreesPerStep;
         }
         double getAccelMin(void) { return _accelMin; }
         double getAccelDegMin()
         {
-            return _accelMin * 360.0 / (double)_steps_per_rev;
+            return _accelMin * _degreesPerStep;
         }
         double getAccelMax(void) { return _accelMax; }
         double getAccelDegMax()
         {
-            return _accelMax * 360.0 / (double)_steps_per_rev;
+            return _accelMax * _degreesPerStep;
         }
 
         double getMaxPositionDeg()
         {
-            return (double)_maxPos * 360.0 / (double)_steps_per_rev;
+            return (double)_maxPos * _degreesPerStep;
         }
         double getMinPositionDeg()
         {
-            return (double)_minPos * 360.0 / (double)_steps_per_rev;
+            return (double)_minPos * _degreesPerStep;
         }
 
     protected:
         bool isRunning()
         {
-            return !(_position == _targetPos && _curSpeed == 0.0 &&
+            return !(_position == _targetPos && _curSpeed == 0 &&
                      _accSteps == 0 && _reversing == false);
         }
 
@@ -93,25 +281,116 @@ class StepperCore
 
         void configureMotion(double timerPeriodSec, long stepsPerRev,
                              long minPos, long maxPos);
+        double speedStepsPerSec(double rawSpeed);
+        long wrapPosition(long position);
+        double clampSpeed(double speedDeg);
+        double clampAcceleration(double accelerationDeg);
+        long resolveTarget(double targetDeg, RotaryMode mode, bool modulo,
+                           long from);
+
+        // Speed and acceleration already clamped and in steps.
+        void applyClampedCommand(double targetDeg, double speed,
+                               double acceleration, RotaryMode mode,
+                               bool modulo);
+        void publishPlan(long target, bool retarget, bool brakeFirst,
+                         double acceleration, double startSpeed, long distance);
+        void fillPlan(StepperPlan& plan, double acceleration, double startSpeed,
+                      long distance);
+        double stopDistance(double speed, double acceleration, double rising);
+        void STEPPER_IRAM_ATTR adoptPlan();
+
+        bool segmentContinues()
+        {
+            return _segmentReady && _segmentPlan.continues;
+        }
+        void STEPPER_IRAM_ATTR adoptSegment();
+#if defined(STEPPER_STEP_SCHEDULING)
+        uint32_t STEPPER_IRAM_ATTR advanceStep();
+#else
+        int8_t STEPPER_IRAM_ATTR advanceMotion();
+        StepperTick STEPPER_IRAM_ATTR jerkLimitedSpeed(const StepperPlan& plan,
+                                                       StepperTick magnitude,
+                                                       long distance);
+        StepperTick STEPPER_IRAM_ATTR jerkCommand(const StepperPlan& plan,
+                                                  StepperTick acceleration,
+                                                  StepperTick gap);
+#endif
 
         void STEPPER_IRAM_ATTR emitStep(int direction);
+        void STEPPER_IRAM_ATTR publishSnapshot();
+        void readSnapshot(StepperSnapshot& snapshot);
         void enterCritical();
         void leaveCritical();
 
         uint8_t _stepPin = 0;
         uint8_t _dirPin = 0;
         volatile long _position = 0;
-        volatile double _curSpeed = 0.0;
-        volatile double _accSteps = 0.0;
+#if defined(STEPPER_STEP_SCHEDULING)
+        // Signed interval to the next step in 1/256 us (0 when stopped) and
+        // signed index in the current ramp (negative while braking).
+        volatile int32_t _curSpeed = 0;
+        volatile long _accSteps = 0;
+#else
+        volatile StepperTick _curSpeed = 0;
+        volatile StepperTick _accSteps = 0;
+        volatile StepperTick _curAccel = 0;
+#if defined(STEPPER_TWO_PHASE_PULSE)
+        // A step was emitted in the last period and its pulse is still high.
+        bool _pulseHigh = false;
+#endif
+#endif
         volatile bool _reversing = false;
+        // The current reversal is an emergency stop.
+        volatile bool _haltBraking = false;
+
+        // Written by publishSnapshot() from the interrupt, or from the main
+        // loop with interrupts masked; read by readSnapshot() without.
+        StepperSnapshot _snapshot = {};
+        volatile StepperSequence _snapshotSequence = 0;
 
         double _vmax = 1500.0;
         double _accel = 8000.0;
+        double _jerk = 0.0;
         long _targetPos = 0;
         long _targetDuringReverse = 0;
 
+        // Double-buffered plan: the main loop fills the inactive slot and
+        // raises _planPending, the interrupt flips _activePlan on its next
+        // call. _plannedTarget is the last target handed to the interrupt.
+        StepperPlan _plans[2];
+        volatile uint8_t _activePlan = 0;
+        volatile bool _planPending = false;
+        long _plannedTarget = 0;
+        int8_t _plannedDirection = 0;
+        // After emergencyStop() _plannedTarget is only the predicted
+        // stopping point: the next command always retargets, and
+        // serviceSegments() takes the real one once the motor has stopped.
+        bool _halting = false;
+        double _emergencyDecel = 0.0;
+
+        // Segments waiting behind the current move. serviceSegments() plans
+        // the oldest one into _segmentPlan as soon as the interrupt has taken
+        // the previous one; _segmentBefore keeps what it replaced so that a
+        // flush can restore it.
+        StepperSegment _segments[STEPPER_SEGMENT_QUEUE_SIZE];
+        uint8_t _segmentHead = 0;
+        uint8_t _segmentCount = 0;
+        StepperPlan _segmentPlan;
+        volatile bool _segmentReady = false;
+        StepperSegment _segmentBefore;
+        int8_t _directionBefore = 0;
+
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+        IsrProbe _probe;
+#endif
+
         double _timerPeriod = 480e-6;
         long _steps_per_rev = 32000;
+        // Conversions cached by configureMotion() so that the telemetry
+        // and command paths multiply instead of dividing.
+        double _degreesPerStep = 360.0 / 32000;
+        double _stepsPerDegree = 32000 / 360.0;
+        double _speedScale = 1.0 / (STEPPER_TICK_ONE * 480e-6);
         long _minPos = 0;
         long _maxPos = 32000;
         double _vmaxMin = 1;
@@ -120,4 +399,51 @@ class StepperCore
         double _accelMax = 10000.0;
 };
 
-#endif
\ No newline at end of file
+// Wraps a step position into [0, stepsPerRev). Up to a revolution either
+// side costs a compare and a subtraction; the division is only left for a
+// motor that has turned several revolutions without stopping.
+inline long wrapRevolution(long position, long stepsPerRev)
+{
+    if (position >= stepsPerRev) {
+        position -= stepsPerRev;
+        if (position < stepsPerRev) return position;
+    } else if (position < 0) {
+        position += stepsPerRev;
+        if (position >= 0) return position;
+    } else {
+        return position;
+    }
+
+    long wrapped = position % stepsPerRev;
+    return wrapped < 0 ? wrapped + stepsPerRev : wrapped;
+}
+
+// StepperCore with its power-on gearing, timer period and modulo handling
+// given by its type, for the motor tables of the targets, so that the
+// configuration is checked when the firmware is built. The motor runs on
+// the runtime fields all the same: the protocol reaches it through
+// StepperCore*, and M can still retune it.
+template <long StepsPerRev, uint32_t PeriodUs, bool Modulo>
+class StepperCoreT : public StepperCore
+{
+    public:
+        static_assert(StepsPerRev > 0, "a revolution needs at least one step");
+        static_assert(PeriodUs > 0, "the timer period must not be zero");
+#if defined(STEPPER_TWO_PHASE_PULSE)
+        static_assert(PeriodUs >= STEPPER_PULSE_WIDTH_US,
+                      "the step pulse lasts one timer period");
+#endif
+
+        static constexpr long STEPS_PER_REV = StepsPerRev;
+        static constexpr uint32_t PERIOD_US = PeriodUs;
+        static constexpr bool MODULO = Modulo;
+        static constexpr double TIMER_PERIOD = PeriodUs * 1e-6;
+
+        void Setup(uint8_t stepPin, uint8_t dirPin, long minPos, long maxPos)
+        {
+            StepperCore::Setup(stepPin, dirPin, TIMER_PERIOD, StepsPerRev,
+                               minPos, maxPos);
+        }
+};
+
+#endif
@@ -0,0 +1,230 @@
+#include "Arduino.h"
+
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+thread_local NativeIoCounters nativeIo;
+
+namespace {
+constexpr uint16_t nativePinCount = 64;
+
+thread_local unsigned long long virtualMicros = 0;
+thread_local uint8_t pinLevels[nativePinCount];
+thread_local unsigned long long pinRises[nativePinCount];
+thread_local unsigned long long pinRiseTimes[nativePinCount];
+thread_local unsigned long long shortestPulses[nativePinCount];
+
+void setPinLevel(uint8_t pin, uint8_t level)
+{
+    if (level == HIGH && pinLevels[pin] == LOW) {
+        ++pinRises[pin];
+        pinRiseTimes[pin] = virtualMicros;
+    } else if (level == LOW && pinLevels[pin] == HIGH) {
+        unsigned long long width = virtualMicros - pinRiseTimes[pin];
+        if (width < shortestPulses[pin]) shortestPulses[pin] = width;
+    }
+    pinLevels[pin] = level;
+}
+}
+
+void nativeResetIo()
+{
+    memset(&nativeIo, 0, sizeof(nativeIo));
+    memset(pinLevels, 0, sizeof(pinLevels));
+    memset(pinRises, 0, sizeof(pinRises));
+    memset(pinRiseTimes, 0, sizeof(pinRiseTimes));
+    for (uint16_t pin = 0; pin < nativePinCount; ++pin)
+        shortestPulses[pin] = ULLONG_MAX;
+}
+
+void nativeAdvanceMicros(unsigned long us)
+{
+    virtualMicros += us;
+}
+
+unsigned long long nativeRisingEdges(uint8_t pin)
+{
+    return pin < nativePinCount ? pinRises[pin] : 0;
+}
+
+unsigned long long nativeShortestPulse(uint8_t pin)
+{
+    return pin < nativePinCount ? shortestPulses[pin] : ULLONG_MAX;
+}
+
+void nativePortSet(uint32_t mask)
+{
+    ++nativeIo.pinWrites;
+    while (mask) {
+        setPinLevel((uint8_t)__builtin_ctz(mask), HIGH);
+        mask &= mask - 1;
+    }
+}
+
+void nativePortClear(uint32_t mask)
+{
+    ++nativeIo.pinWrites;
+    while (mask) {
+        setPinLevel((uint8_t)__builtin_ctz(mask), LOW);
+        mask &= mask - 1;
+    }
+}
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    (void)pin;
+    (void)mode;
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    ++nativeIo.pinWrites;
+    if (pin >= nativePinCount) return;
+
+    setPinLevel(pin, value ? HIGH : LOW);
+}
+
+int digitalRead(uint8_t pin)
+{
+    return pin < nativePinCount ? pinLevels[pin] : LOW;
+}
+
+void delay(unsigned long ms)
+{
+    ++nativeIo.delayCalls;
+    nativeIo.delayMicros += ms * 1000ULL;
+    virtualMicros += ms * 1000ULL;
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    ++nativeIo.delayCalls;
+    nativeIo.delayMicros += us;
+    virtualMicros += us;
+}
+
+unsigned long millis()
+{
+    return (unsigned long)(virtualMicros / 1000ULL);
+}
+
+unsigned long micros()
+{
+    return (unsigned long)virtualMicros;
+}
+
+void yield()
+{
+}
+
+void cli()
+{
+    ++nativeIo.criticalSections;
+}
+
+void sei()
+{
+}
+
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+    size_t written = 0;
+    while (size--) {
+        if (!write(*buffer++)) break;
+        ++written;
+    }
+    return written;
+}
+
+size_t Print::printFormatted(const char* format, ...)
+{
+    char text[48];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+
+    if (length < 0) return 0;
+    if (length >= (int)sizeof(text)) length = sizeof(text) - 1;
+    return write((const uint8_t*)text, (size_t)length);
+}
+
+size_t Print::print(const char* text) { return write(text); }
+size_t Print::print(char value) { return write((uint8_t)value); }
+
+size_t Print::print(unsigned char value, int base)
+{
+    return print((unsigned long)value, base);
+}
+
+size_t Print::print(int value, int base)
+{
+    return print((long)value, base);
+}
+
+size_t Print::print(unsigned int value, int base)
+{
+    return print((unsigned long)value, base);
+}
+
+size_t Print::print(long value, int base)
+{
+    if (base == HEX) return printFormatted("%lX", (unsigned long)value);
+    return printFormatted("%ld", value);
+}
+
+size_t Print::print(unsigned long value, int base)
+{
+    if (base == HEX) return printFormatted("%lX", value);
+    return printFormatted("%lu", value);
+}
+
+size_t Print::print(double value, int digits)
+{
+    if (isnan(value)) return print("nan");
+    if (isinf(value)) return print("inf");
+    return printFormatted("%.*f", digits, value);
+}
+
+size_t Print::println() { return write((const uint8_t*)"\r\n", 2); }
+size_t Print::println(const char* text) { return print(text) + println(); }
+
+size_t Print::println(int value, int base)
+{
+    return print(value, base) + println();
+}
+
+size_t Print::println(long value, int base)
+{
+    return print(value, base) + println();
+}
+
+size_t Print::println(unsigned long value, int base)
+{
+    return print(value, base) + println();
+}
+
+size_t Print::println(double value, int digits)
+{
+    return print(value, digits) + println();
+}
+
+size_t Stream::readBytesUntil(char terminator, char* buffer, size_t length)
+{
+    size_t count = 0;
+    while (count < length && available()) {
+        int value = read();
+        if (value < 0 || (char)value == terminator) break;
+        buffer[count++] = (char)value;
+    }
+    return count;
+}
+
+bool Stream::find(char target)
+{
+    while (available()) {
+        if ((char)read() == target) return true;
+    }
+    return false;
+}
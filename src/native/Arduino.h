@@ -0,0 +1,115 @@
+#ifndef NATIVE_ARDUINO_H
+#define NATIVE_ARDUINO_H
+
+// Minimal Arduino API used to build the shared sources on the host.
+// Pin writes, delays and interrupt masking only update counters; time is
+// virtual and advanced explicitly by the host tools.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#define HIGH 0x1
+#define LOW 0x0
+
+#define INPUT 0x0
+#define OUTPUT 0x1
+#define INPUT_PULLUP 0x2
+
+#define DEC 10
+#define HEX 16
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+struct NativeIoCounters
+{
+    unsigned long long pinWrites;
+    unsigned long long delayCalls;
+    unsigned long long delayMicros;
+    unsigned long long criticalSections;
+};
+
+// The I/O state is per thread, so that host tools can run one motor per
+// thread without sharing pins or the virtual clock.
+extern thread_local NativeIoCounters nativeIo;
+
+void nativeResetIo();
+void nativeAdvanceMicros(unsigned long us);
+unsigned long long nativeRisingEdges(uint8_t pin);
+// Shortest completed high pulse on the pin in virtual microseconds,
+// ULLONG_MAX before the first one.
+unsigned long long nativeShortestPulse(uint8_t pin);
+
+// Single-register writes of pins 0 to 31, as the W1TS / W1TC registers of
+// the ESP32 GPIO port. Each call counts as one pin write.
+void nativePortSet(uint32_t mask);
+void nativePortClear(uint32_t mask);
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+unsigned long millis();
+unsigned long micros();
+void yield();
+
+void cli();
+void sei();
+#define noInterrupts() cli()
+#define interrupts() sei()
+
+class Print
+{
+    public:
+        virtual ~Print() {}
+
+        virtual size_t write(uint8_t value) = 0;
+        virtual size_t write(const uint8_t* buffer, size_t size);
+        virtual int availableForWrite() { return 0; }
+
+        size_t write(const char* text)
+        {
+            return text ? write((const uint8_t*)text, strlen(text)) : 0;
+        }
+
+        size_t print(const char* text);
+        size_t print(char value);
+        size_t print(unsigned char value, int base = DEC);
+        size_t print(int value, int base = DEC);
+        size_t print(unsigned int value, int base = DEC);
+        size_t print(long value, int base = DEC);
+        size_t print(unsigned long value, int base = DEC);
+        size_t print(double value, int digits = 2);
+
+        size_t println();
+        size_t println(const char* text);
+        size_t println(int value, int base = DEC);
+        size_t println(long value, int base = DEC);
+        size_t println(unsigned long value, int base = DEC);
+        size_t println(double value, int digits = 2);
+
+    private:
+        size_t printFormatted(const char* format, ...);
+};
+
+class Stream : public Print
+{
+    public:
+        virtual int available() = 0;
+        virtual int read() = 0;
+        virtual int peek() = 0;
+
+        void setTimeout(unsigned long timeout) { _timeout = timeout; }
+
+        size_t readBytesUntil(char terminator, char* buffer, size_t length);
+        bool find(char target);
+
+    protected:
+        unsigned long _timeout = 1000;
+};
+
+#endif
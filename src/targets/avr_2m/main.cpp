@@ -1,35 +1,103 @@
 #include <Arduino.h>
 #include "timer.h"
 #include "../../common/moving_speaker_protocol.h"
+#include "../../common/stepper_bank.h"
 
 CounterA counterA;
 CounterB counterB;
 uint16_t timerTicksA;
 uint16_t timerTicksB;
 
-StepperCore stepperA;
-StepperCore stepperB;
+#if defined(STEPPER_STEP_SCHEDULING)
+constexpr uint32_t motorTimerPeriodUs = 100;
+#else
+constexpr uint32_t motorTimerPeriodUs = 480;
+#endif
+constexpr double motorTimerPeriod = motorTimerPeriodUs * 1e-6;
+
+typedef StepperCoreT<32000, motorTimerPeriodUs, false> LimitedStepper;
+typedef StepperCoreT<32000, motorTimerPeriodUs, true> ModuloStepper;
+
+LimitedStepper stepperA;
+ModuloStepper stepperB;
 
 MotorChannel motors[] = {
-    { &stepperA, false },
-    { &stepperB, true },
+    { &stepperA, LimitedStepper::MODULO, 0 },
+    { &stepperB, ModuloStepper::MODULO, 0 },
 };
 
 MovingSpeakerProtocol protocol(
     Serial, motors, 2,
     "I: Moving Speaker V2.1 by D\xC3\xA9tourner");
 
+#if defined(STEPPER_STEP_SCHEDULING)
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+static IsrProbe timerProbes[2];
+#endif
+
+static inline uint16_t stepTicks(uint32_t intervalUs)
+{
+    uint32_t ticks = intervalUs / C250kHz;
+    if (ticks > Counter::MAX_VALUE) ticks = Counter::MAX_VALUE;
+    return ticks ? ticks : 1;
+}
+
 ISR(TIMER1_COMPA_vect)
 {
-    counterA.Set(timerTicksA);
-    stepperA.RunISR();
+    ISR_PROBE_BEGIN(timerProbes[0]);
+    uint16_t ticks = stepTicks(stepperA.RunStepISR());
+    counterA.Increment(ticks);
+    ISR_PROBE_PERIOD_US(timerProbes[0], (uint32_t)ticks * C250kHz);
+    ISR_PROBE_END(timerProbes[0]);
 }
 
 ISR(TIMER1_COMPB_vect)
 {
-    counterB.Set(timerTicksB);
-    stepperB.RunISR();
+    ISR_PROBE_BEGIN(timerProbes[1]);
+    uint16_t ticks = stepTicks(stepperB.RunStepISR());
+    counterB.Increment(ticks);
+    ISR_PROBE_PERIOD_US(timerProbes[1], (uint32_t)ticks * C250kHz);
+    ISR_PROBE_END(timerProbes[1]);
+}
+
+// The period only bounds the step interval; the compares follow the steps.
+static bool setTimerPeriod(uint8_t group, uint32_t periodUs)
+{
+    (void)group;
+    (void)periodUs;
+    return true;
+}
+#else
+// Both motors are on PORTD and run as one bank from compare A.
+StepperBank bank;
+
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+static IsrProbe timerProbes[1];
+#endif
+
+ISR(TIMER1_COMPA_vect)
+{
+    ISR_PROBE_BEGIN(timerProbes[0]);
+    counterA.Set(timerTicksA);
+    bank.RunISR();
+    ISR_PROBE_END(timerProbes[0]);
+}
+
+// Timer1 counts in 4 us steps at 250 kHz, so the period must be a multiple.
+static bool setTimerPeriod(uint8_t group, uint32_t periodUs)
+{
+    (void)group;
+    uint32_t ticks = periodUs / Counter::getTicksPeruSec();
+    if (ticks * Counter::getTicksPeruSec() != periodUs || ticks > Counter::MAX_VALUE)
+        return false;
+
+    noInterrupts();
+    timerTicksA = (uint16_t)ticks;
+    ISR_PROBE_PERIOD_US(timerProbes[0], periodUs);
+    interrupts();
+    return true;
 }
+#endif
 
 static uint16_t setupCounter(Counter& counter, double timerPeriodSec)
 {
@@ -45,12 +113,28 @@ void setup()
     Serial.begin(115200);
 
     Counter::Setup(C250kHz);
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+    for (IsrProbe& probe : timerProbes) {
+        probe.calibrate();
+        probe.setPeriod(motorTimerPeriod);
+    }
+    protocol.setIsrProbes(timerProbes, sizeof(timerProbes) / sizeof(timerProbes[0]));
+#endif
 
-    stepperA.Setup(3, 2, 480e-6, 32000, -8000, 8000);
-    timerTicksA = setupCounter(counterA, 480e-6);
+#if defined(STEPPER_STEP_SCHEDULING)
+    stepperA.Setup(3, 2, -8000, 8000);
+    timerTicksA = setupCounter(counterA, motorTimerPeriod);
     delayMicroseconds(100);
-    stepperB.Setup(5, 4, 480e-6, 32000, 0, 32000);
-    timerTicksB = setupCounter(counterB, 480e-6);
+    stepperB.Setup(5, 4, 0, 32000);
+    timerTicksB = setupCounter(counterB, motorTimerPeriod);
+#else
+    stepperA.Setup(3, 2, -8000, 8000);
+    stepperB.Setup(5, 4, 0, 32000);
+    bank.add(stepperA);
+    bank.add(stepperB);
+    timerTicksA = setupCounter(counterA, motorTimerPeriod);
+#endif
+    protocol.setTimerPeriodHandler(setTimerPeriod);
 
     protocol.sendInfoFrame();
 }
@@ -1,16 +1,27 @@
 #include <Arduino.h>
 #include "../../common/moving_speaker_protocol.h"
+#include "../../common/stepper_bank.h"
 
-StepperCore stepperA;
-StepperCore stepperB;
-StepperCore stepperC;
-StepperCore stepperD;
+#if defined(STEPPER_STEP_SCHEDULING)
+constexpr uint32_t motorTimerPeriodUs = 48;
+#else
+constexpr uint32_t motorTimerPeriodUs = 480;
+#endif
+constexpr double motorTimerPeriod = motorTimerPeriodUs * 1e-6;
+
+typedef StepperCoreT<32000, motorTimerPeriodUs, false> LimitedStepper;
+typedef StepperCoreT<16000, motorTimerPeriodUs, true> ModuloStepper;
+
+LimitedStepper stepperA;
+ModuloStepper stepperB;
+LimitedStepper stepperC;
+ModuloStepper stepperD;
 
 MotorChannel motors[] = {
-    { &stepperA, false },
-    { &stepperB, true },
-    { &stepperC, false },
-    { &stepperD, true },
+    { &stepperA, LimitedStepper::MODULO, 0 },
+    { &stepperB, ModuloStepper::MODULO, 0 },
+    { &stepperC, LimitedStepper::MODULO, 1 },
+    { &stepperD, ModuloStepper::MODULO, 1 },
 };
 
 MovingSpeakerProtocol protocol(
@@ -20,52 +31,341 @@ MovingSpeakerProtocol protocol(
 static hw_timer_t* timerGroup0 = nullptr;
 static hw_timer_t* timerGroup1 = nullptr;
 
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+static IsrProbe timerProbes[2];
+#endif
+
+#if defined(STEPPER_STEP_SCHEDULING)
+// Each timer group runs free at 1 MHz and its alarm is moved to the
+// earliest step deadline of the two motors it serves.
+struct StepSchedule
+{
+    StepperCore* stepper;
+    uint64_t due;
+};
+
+static StepSchedule scheduleGroup0[] = { { &stepperA, 0 }, { &stepperB, 0 } };
+static StepSchedule scheduleGroup1[] = { { &stepperC, 0 }, { &stepperD, 0 } };
+static uint64_t alarmGroup0 = 0;
+static uint64_t alarmGroup1 = 0;
+
+// Returns the time to the next alarm.
+static uint32_t IRAM_ATTR serviceGroup(hw_timer_t* timer, StepSchedule* group,
+                                       uint64_t& alarm)
+{
+    uint64_t now = alarm;
+    uint64_t next = UINT64_MAX;
+
+    for (uint8_t index = 0; index < 2; ++index) {
+        if (group[index].due <= now)
+            group[index].due = now + group[index].stepper->RunStepISR();
+        if (group[index].due < next) next = group[index].due;
+    }
+
+    alarm = next;
+    timerAlarm(timer, next, false, 0);
+    return (uint32_t)(next - now);
+}
+
 void IRAM_ATTR timerGroupISR0()
 {
-    stepperA.RunISR();
-    stepperB.RunISR();
+    ISR_PROBE_BEGIN(timerProbes[0]);
+    uint32_t interval = serviceGroup(timerGroup0, scheduleGroup0, alarmGroup0);
+    ISR_PROBE_PERIOD_US(timerProbes[0], interval);
+    ISR_PROBE_END(timerProbes[0]);
+    (void)interval;
 }
 
 void IRAM_ATTR timerGroupISR1()
 {
-    stepperC.RunISR();
-    stepperD.RunISR();
+    ISR_PROBE_BEGIN(timerProbes[1]);
+    uint32_t interval = serviceGroup(timerGroup1, scheduleGroup1, alarmGroup1);
+    ISR_PROBE_PERIOD_US(timerProbes[1], interval);
+    ISR_PROBE_END(timerProbes[1]);
+    (void)interval;
+}
+
+// The period only bounds the step interval; the alarms follow the steps.
+static bool setGroupTimerPeriod(uint8_t group, uint32_t periodUs)
+{
+    (void)group;
+    (void)periodUs;
+    return true;
+}
+
+static void setupMotorTimers()
+{
+    timerGroup0 = timerBegin(1000000);
+    if (timerGroup0) {
+        timerAttachInterrupt(timerGroup0, timerGroupISR0);
+        alarmGroup0 = STEPPER_IDLE_INTERVAL_US;
+        timerAlarm(timerGroup0, alarmGroup0, false, 0);
+        timerStart(timerGroup0);
+    }
+
+    timerGroup1 = timerBegin(1000000);
+    if (timerGroup1) {
+        timerAttachInterrupt(timerGroup1, timerGroupISR1);
+        alarmGroup1 = STEPPER_IDLE_INTERVAL_US;
+        timerAlarm(timerGroup1, alarmGroup1, false, 0);
+        timerStart(timerGroup1);
+    }
+}
+#else
+// Each timer group drives its motors as one bank, so the step pulses of a
+// period share a single pulse-width wait.
+static StepperBank bankGroup0;
+static StepperBank bankGroup1;
+
+void IRAM_ATTR timerGroupISR0()
+{
+    ISR_PROBE_BEGIN(timerProbes[0]);
+    bankGroup0.RunISR();
+    ISR_PROBE_END(timerProbes[0]);
+}
+
+void IRAM_ATTR timerGroupISR1()
+{
+    ISR_PROBE_BEGIN(timerProbes[1]);
+    bankGroup1.RunISR();
+    ISR_PROBE_END(timerProbes[1]);
+}
+
+static bool setGroupTimerPeriod(uint8_t group, uint32_t periodUs)
+{
+    hw_timer_t* timer = group == 0 ? timerGroup0 : timerGroup1;
+    if (!timer) return false;
+
+    timerAlarm(timer, periodUs, true, 0);
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+    timerProbes[group].setPeriod(periodUs * 1e-6);
+#endif
+    return true;
 }
 
 static void setupMotorTimers()
 {
-    constexpr uint64_t timerPeriodUs = 480;
+    bankGroup0.add(stepperA);
+    bankGroup0.add(stepperB);
+    bankGroup1.add(stepperC);
+    bankGroup1.add(stepperD);
 
     timerGroup0 = timerBegin(1000000);
     if (timerGroup0) {
         timerAttachInterrupt(timerGroup0, timerGroupISR0);
-        timerAlarm(timerGroup0, timerPeriodUs, true, 0);
+        timerAlarm(timerGroup0, motorTimerPeriodUs, true, 0);
         timerStart(timerGroup0);
     }
 
     timerGroup1 = timerBegin(1000000);
     if (timerGroup1) {
         timerAttachInterrupt(timerGroup1, timerGroupISR1);
-        timerAlarm(timerGroup1, timerPeriodUs, true, 0);
+        timerAlarm(timerGroup1, motorTimerPeriodUs, true, 0);
         timerStart(timerGroup1);
     }
 }
+#endif
+
+#if defined(ESP32_PROTOCOL_TASKS)
+// The protocol runs from three tasks instead of loop(): the RX task wakes
+// on received bytes and queues complete lines, the command task executes
+// them and services the segment queues, and the telemetry task sends the P
+// frames on its own schedule. Each takes protocolLock around the protocol.
+// Frames are formatted under the lock and handed to a 1 KB TX buffer; when
+// the buffer is full, the task waits for it with the lock released, so the
+// RX task keeps reading (and seeing stop bytes) and the lower priority
+// tasks run meanwhile.
+constexpr UBaseType_t commandTaskPriority = 4;
+constexpr UBaseType_t rxTaskPriority = 3;
+constexpr UBaseType_t telemetryTaskPriority = 2;
+constexpr uint32_t protocolTaskStack = 4096;
+constexpr uint8_t commandQueueLength = 4;
+constexpr size_t serialTxBufferSize = 1024;
+
+struct CommandLine
+{
+    uint16_t length;
+    char text[MovingSpeakerProtocol::LINE_SIZE];
+};
+
+static SemaphoreHandle_t protocolLock = nullptr;
+static QueueHandle_t commandQueue = nullptr;
+static TaskHandle_t rxTask = nullptr;
+
+#if ARDUINO_USB_CDC_ON_BOOT
+static void serialReceived(void* arg, esp_event_base_t base, int32_t id,
+                           void* data)
+{
+    (void)arg;
+    (void)base;
+    (void)id;
+    (void)data;
+    xTaskNotifyGive(rxTask);
+}
+#else
+static void serialReceived()
+{
+    xTaskNotifyGive(rxTask);
+}
+#endif
+
+// Takes protocolLock once the protocol has no output pending. The pending
+// frame is flushed under the lock in short turns; the wait for the port
+// in between is a blocking delay without the lock.
+static void takeProtocolIdle()
+{
+    for (;;) {
+        xSemaphoreTake(protocolLock, portMAX_DELAY);
+        if (protocol.flushOutput()) return;
+        xSemaphoreGive(protocolLock);
+        vTaskDelay(1);
+    }
+}
+
+static void flushProtocolOutput()
+{
+    takeProtocolIdle();
+    xSemaphoreGive(protocolLock);
+}
+
+static void rxTaskMain(void* arg)
+{
+    (void)arg;
+    CommandLine line;
+    // A line taken from the protocol that did not fit into the queue yet.
+    bool holding = false;
+
+    for (;;) {
+        // Bytes normally arrive with a receive event; the timeout is a
+        // fallback should one be missed.
+        ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(10));
+
+        for (;;) {
+            xSemaphoreTake(protocolLock, portMAX_DELAY);
+            uint32_t stops = protocol.getEmergencyStops();
+            int16_t length = -1;
+            if (holding) {
+                protocol.pollInput();
+            } else {
+                length = protocol.receiveLine(line.text, sizeof(line.text));
+            }
+            bool stopped = protocol.getEmergencyStops() != stops;
+            xSemaphoreGive(protocolLock);
+            // Lines queued before a stop are dropped with it.
+            if (stopped) {
+                xQueueReset(commandQueue);
+                holding = false;
+            }
+            if (length >= 0) {
+                line.length = (uint16_t)length;
+                holding = true;
+            }
+            if (!holding) break;
+
+            // A full queue is waited on a tick at a time, reading the port
+            // in between so that a stop byte is not held up behind it.
+            if (xQueueSend(commandQueue, &line, 1) == pdTRUE) holding = false;
+        }
+    }
+}
+
+static void commandTaskMain(void* arg)
+{
+    (void)arg;
+    CommandLine line;
+
+    for (;;) {
+        uint32_t stops = protocol.getEmergencyStops();
+        bool received = xQueueReceive(commandQueue, &line, pdMS_TO_TICKS(1)) == pdTRUE;
+
+        // Servicing the segment queues alone does not wait for the port.
+        if (received) {
+            takeProtocolIdle();
+        } else {
+            xSemaphoreTake(protocolLock, portMAX_DELAY);
+        }
+        // A line taken off the queue just before a stop goes with it.
+        if (received && protocol.getEmergencyStops() == stops)
+            protocol.handleLine(line.text, line.length,
+                                uxQueueMessagesWaiting(commandQueue) > 0);
+        protocol.serviceMotion();
+        xSemaphoreGive(protocolLock);
+        if (received) flushProtocolOutput();
+    }
+}
+
+// Without a subscription the modulo motors are still renormalized every
+// 100 ms.
+static void telemetryTaskMain(void* arg)
+{
+    (void)arg;
+    TickType_t wake = xTaskGetTickCount();
+
+    for (;;) {
+        takeProtocolIdle();
+        uint16_t period = protocol.getTelemetryPeriod();
+        protocol.sendTelemetry();
+        xSemaphoreGive(protocolLock);
+        flushProtocolOutput();
+
+        TickType_t ticks = pdMS_TO_TICKS(period ? period : 100);
+        vTaskDelayUntil(&wake, ticks ? ticks : 1);
+    }
+}
+
+static void startProtocolTasks()
+{
+    protocolLock = xSemaphoreCreateMutex();
+    commandQueue = xQueueCreate(commandQueueLength, sizeof(CommandLine));
+
+    xTaskCreate(commandTaskMain, "command", protocolTaskStack, nullptr,
+                commandTaskPriority, nullptr);
+    xTaskCreate(rxTaskMain, "rx", protocolTaskStack, nullptr, rxTaskPriority,
+                &rxTask);
+    xTaskCreate(telemetryTaskMain, "telemetry", protocolTaskStack, nullptr,
+                telemetryTaskPriority, nullptr);
+
+#if ARDUINO_USB_CDC_ON_BOOT
+    Serial.onEvent(ARDUINO_HW_CDC_RX_EVENT, serialReceived);
+#else
+    Serial.onReceive(serialReceived);
+#endif
+}
+#endif
 
 void setup()
 {
+#if defined(ESP32_PROTOCOL_TASKS)
+    Serial.setTxBufferSize(serialTxBufferSize);
+#endif
     Serial.begin(115200);
     delay(1000);
 
-    stepperA.Setup(D0, D1, 480e-6, 32000, -8000, 8000);
-    stepperB.Setup(D2, D3, 480e-6, 16000, 0, 16000);
-    stepperC.Setup(D4, D5, 480e-6, 32000, -8000, 8000);
-    stepperD.Setup(D7, D8, 480e-6, 16000, 0, 16000);
+    stepperA.Setup(D0, D1, -8000, 8000);
+    stepperB.Setup(D2, D3, 0, 16000);
+    stepperC.Setup(D4, D5, -8000, 8000);
+    stepperD.Setup(D7, D8, 0, 16000);
+#if defined(STEPPER_ISR_DIAGNOSTICS)
+    for (IsrProbe& probe : timerProbes) {
+        probe.calibrate();
+        probe.setPeriod(motorTimerPeriod);
+    }
+    protocol.setIsrProbes(timerProbes, 2);
+#endif
     setupMotorTimers();
+    protocol.setTimerPeriodHandler(setGroupTimerPeriod);
 
     protocol.sendInfoFrame();
+#if defined(ESP32_PROTOCOL_TASKS)
+    startProtocolTasks();
+#endif
 }
 
 void loop()
 {
+#if defined(ESP32_PROTOCOL_TASKS)
+    vTaskDelete(nullptr);
+#else
     protocol.process();
+#endif
 }
\ No newline at end of file
@@ -0,0 +1,270 @@
+#include <Arduino.h>
+#include <chrono>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../common/stepper_core.h"
+#include "../../common/stepper_bank.h"
+
+// Host micro-benchmark of StepperCore::RunISR().
+//
+// A single motor configured like motor A of the targets is driven through
+// accelerate / cruise / decelerate / reversal sequences. Every RunISR() call
+// is timed individually and charged to the phase the motor was in when the
+// call started. With STEPPER_STEP_SCHEDULING one call is one step and the
+// virtual clock advances by the interval RunStepISR() returns.
+//
+// Usage: native [cycles] [motors]. With motors > 0 (tick kernel only) that
+// many identical motors run the sequences through one StepperBank and each
+// StepperBank::RunISR() call is timed instead.
+
+namespace {
+using BenchClock = std::chrono::steady_clock;
+
+enum BenchPhase : uint8_t {
+    PHASE_ACCEL,
+    PHASE_CRUISE,
+    PHASE_DECEL,
+    PHASE_REVERSAL,
+    PHASE_IDLE,
+    PHASE_COUNT,
+};
+
+const char* const phaseNames[PHASE_COUNT] = {
+    "accel", "cruise", "decel", "reversal", "idle",
+};
+
+// Per-call histogram in 1 ns buckets, used for a percentile that is not
+// dominated by host preemption like the worst case is.
+constexpr uint16_t histogramBuckets = 4096;
+
+struct PhaseStats
+{
+    unsigned long long calls;
+    double totalNs;
+    double worstNs;
+    unsigned long long histogram[histogramBuckets];
+};
+
+class BenchStepper : public StepperCore
+{
+    public:
+        bool reversing() const { return _reversing; }
+        double speed() { return speedStepsPerSec(_curSpeed); }
+        bool running() { return isRunning(); }
+};
+
+constexpr uint8_t benchStepPin = 3;
+constexpr uint8_t benchDirPin = 2;
+constexpr double benchTimerPeriod = 480e-6;
+constexpr unsigned long benchTimerPeriodUs = 480;
+constexpr unsigned long maxTicksPerMove = 200000;
+
+#if defined(STEPPER_TWO_PHASE_PULSE)
+static_assert(benchTimerPeriod * 1e6 >= STEPPER_PULSE_WIDTH_US,
+              "the step pulse lasts one timer period");
+#endif
+
+PhaseStats stats[PHASE_COUNT];
+double clockOverheadNs = 0.0;
+BenchStepper steppers[STEPPER_BANK_MAX_MOTORS];
+BenchStepper& stepper = steppers[0];
+uint8_t motorCount = 1;
+#if !defined(STEPPER_STEP_SCHEDULING)
+StepperBank bank;
+#endif
+
+double elapsedNs(BenchClock::time_point start, BenchClock::time_point end)
+{
+    return std::chrono::duration<double, std::nano>(end - start).count();
+}
+
+void calibrateClock()
+{
+    constexpr unsigned long samples = 200000;
+    double total = 0.0;
+    for (unsigned long index = 0; index < samples; ++index) {
+        BenchClock::time_point start = BenchClock::now();
+        BenchClock::time_point end = BenchClock::now();
+        total += elapsedNs(start, end);
+    }
+    clockOverheadNs = total / samples;
+}
+
+BenchPhase classify(double previousSpeed, double nextSpeed, bool reversing,
+                    bool running)
+{
+    if (reversing) return PHASE_REVERSAL;
+    if (!running && nextSpeed == 0.0) return PHASE_IDLE;
+
+    double before = fabs(previousSpeed);
+    double after = fabs(nextSpeed);
+    if (after > before) return PHASE_ACCEL;
+    if (after < before) return PHASE_DECEL;
+    return PHASE_CRUISE;
+}
+
+unsigned long tick()
+{
+    double previousSpeed = stepper.speed();
+    bool reversing = stepper.reversing();
+    bool running = stepper.running();
+
+    BenchClock::time_point start = BenchClock::now();
+#if defined(STEPPER_STEP_SCHEDULING)
+    unsigned long interval = stepper.RunStepISR();
+#else
+    if (bank.size() > 0) bank.RunISR();
+    else stepper.RunISR();
+    unsigned long interval = benchTimerPeriodUs;
+#endif
+    BenchClock::time_point end = BenchClock::now();
+    nativeAdvanceMicros(interval);
+
+    double ns = elapsedNs(start, end) - clockOverheadNs;
+    if (ns < 0.0) ns = 0.0;
+
+    PhaseStats& phase = stats[classify(previousSpeed, stepper.speed(),
+                                       reversing, running)];
+    ++phase.calls;
+    phase.totalNs += ns;
+    if (ns > phase.worstNs) phase.worstNs = ns;
+    ++phase.histogram[ns < histogramBuckets - 1 ? (uint16_t)ns
+                                                 : histogramBuckets - 1];
+    return interval;
+}
+
+double percentileNs(const PhaseStats& phase, double fraction)
+{
+    unsigned long long rank = (unsigned long long)(phase.calls * fraction);
+    unsigned long long seen = 0;
+    for (uint16_t bucket = 0; bucket < histogramBuckets; ++bucket) {
+        seen += phase.histogram[bucket];
+        if (seen > rank) return bucket;
+    }
+    return histogramBuckets - 1;
+}
+
+// Runs for the given number of 480 us timer periods of virtual time.
+void runTicks(unsigned long ticks)
+{
+    unsigned long long remaining = (unsigned long long)ticks * benchTimerPeriodUs;
+    while (remaining > 0) {
+        unsigned long interval = tick();
+        remaining = interval < remaining ? remaining - interval : 0;
+    }
+}
+
+void runUntilIdle()
+{
+    for (unsigned long index = 0; index < maxTicksPerMove; ++index) {
+        tick();
+        if (!stepper.running()) break;
+    }
+}
+
+// Same command for every motor of the run.
+void command(double targetDeg, double speedDeg, double accelerationDeg)
+{
+    for (uint8_t index = 0; index < motorCount; ++index)
+        steppers[index].applyCommandDegrees(targetDeg, speedDeg,
+                                            accelerationDeg, ROT_SHORTEST,
+                                            false);
+}
+
+void runCycle()
+{
+    // Long move with a cruise phase, interrupted by a reversal mid-way.
+    command(80.0, 20.0, 50.0);
+    runTicks(5000);
+    command(-80.0, 20.0, 50.0);
+    runUntilIdle();
+
+    // Short triangular move that never reaches vmax.
+    command(-75.0, 20.0, 20.0);
+    runUntilIdle();
+
+    // Speed change during cruise, then back home with a high acceleration.
+    command(60.0, 10.0, 100.0);
+    runTicks(8000);
+    command(60.0, 20.0, 100.0);
+    runUntilIdle();
+    command(0.0, 20.0, 100.0);
+    runUntilIdle();
+
+    // A few idle ticks between cycles.
+    runTicks(1000);
+}
+}
+
+int main(int argc, char** argv)
+{
+    unsigned long cycles = 20;
+    if (argc > 1) cycles = strtoul(argv[1], nullptr, 10);
+    if (cycles == 0) cycles = 1;
+
+    unsigned long bankSize = 0;
+    if (argc > 2) bankSize = strtoul(argv[2], nullptr, 10);
+    if (bankSize > STEPPER_BANK_MAX_MOTORS) bankSize = STEPPER_BANK_MAX_MOTORS;
+
+    nativeResetIo();
+    stepper.Setup(benchStepPin, benchDirPin, benchTimerPeriod, 32000, -8000, 8000);
+#if !defined(STEPPER_STEP_SCHEDULING)
+    if (bankSize > 0) {
+        motorCount = (uint8_t)bankSize;
+        for (uint8_t index = 1; index < motorCount; ++index)
+            steppers[index].Setup(benchStepPin + 2 * index, benchDirPin + 2 * index,
+                                  benchTimerPeriod, 32000, -8000, 8000);
+        for (uint8_t index = 0; index < motorCount; ++index)
+            bank.add(steppers[index]);
+    }
+#endif
+    calibrateClock();
+
+    for (unsigned long cycle = 0; cycle < cycles; ++cycle) runCycle();
+
+    printf("StepperCore::RunISR() host benchmark\n");
+#if defined(STEPPER_STEP_SCHEDULING)
+    printf("cycles: %lu, step scheduling, virtual time: %lu ms, "
+           "clock overhead: %.1f ns\n",
+           cycles, millis(), clockOverheadNs);
+#else
+    printf("cycles: %lu, timer period: %lu us, bank motors: %u, "
+           "clock overhead: %.1f ns\n",
+           cycles, benchTimerPeriodUs, bank.size(), clockOverheadNs);
+#endif
+    printf("%-10s %12s %12s %12s %12s\n", "phase", "calls", "ns/call",
+           "p99.9 ns", "worst ns");
+
+    unsigned long long totalCalls = 0;
+    double totalNs = 0.0;
+    double worstNs = 0.0;
+    for (uint8_t index = 0; index < PHASE_COUNT; ++index) {
+        const PhaseStats& phase = stats[index];
+        double average = phase.calls ? phase.totalNs / phase.calls : 0.0;
+        printf("%-10s %12llu %12.1f %12.0f %12.1f\n", phaseNames[index],
+               phase.calls, average, percentileNs(phase, 0.999),
+               phase.worstNs);
+        totalCalls += phase.calls;
+        totalNs += phase.totalNs;
+        if (phase.worstNs > worstNs) worstNs = phase.worstNs;
+    }
+    printf("%-10s %12llu %12.1f %12s %12.1f\n", "all", totalCalls,
+           totalCalls ? totalNs / totalCalls : 0.0, "-", worstNs);
+    printf("steps: %llu, pin writes: %llu, busy-wait: %llu us\n",
+           nativeRisingEdges(benchStepPin), nativeIo.pinWrites,
+           nativeIo.delayMicros);
+
+    // Every STEP pulse must last at least the driver's minimum width.
+    unsigned long long shortestPulse = nativeShortestPulse(benchStepPin);
+    for (uint8_t index = 1; index < motorCount; ++index) {
+        unsigned long long pulse = nativeShortestPulse(benchStepPin + 2 * index);
+        if (pulse < shortestPulse) shortestPulse = pulse;
+    }
+    printf("shortest step pulse: %llu us, minimum: %u us\n", shortestPulse,
+           (unsigned)STEPPER_PULSE_WIDTH_US);
+    if (shortestPulse < STEPPER_PULSE_WIDTH_US) {
+        printf("FAIL: step pulse shorter than STEPPER_PULSE_WIDTH_US\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,383 @@
+#include <Arduino.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "../../common/binary_frame.h"
+#include "../../common/moving_speaker_protocol.h"
+#include "../../common/stepper_bank.h"
+
+// Protocol checks against the firmware code.
+//
+// Each case builds the four esp32_4m motors and a MovingSpeakerProtocol on
+// a virtual clock, as native_replay does, sends protocol lines or raw bytes
+// and checks the answers and the motor state. The cases are independent:
+// every one starts from motors at rest at position 0.
+//
+// Usage: native_protocol. The exit status is 1 when a check failed.
+
+namespace {
+constexpr uint32_t motorTimerPeriodUs = 480;
+#if defined(STEPPER_STEP_SCHEDULING)
+constexpr uint32_t stepPeriodUs = 48;
+#else
+constexpr uint32_t stepPeriodUs = motorTimerPeriodUs;
+#endif
+constexpr uint8_t motorCount = 4;
+constexpr unsigned long maxSettleTicks = 60000000UL / motorTimerPeriodUs;
+
+typedef StepperCoreT<32000, stepPeriodUs, false> LimitedStepper;
+typedef StepperCoreT<16000, stepPeriodUs, true> ModuloStepper;
+
+// Timer periods the protocol asked the target for, in call order.
+std::vector<uint32_t> timerPeriodCalls;
+
+bool recordTimerPeriod(uint8_t group, uint32_t periodUs)
+{
+    timerPeriodCalls.push_back(group * 100000UL + periodUs);
+    return true;
+}
+
+// Host side of the serial link: bytes written into the input, the
+// firmware's frames split into lines as they arrive.
+class ProtocolStream : public Stream
+{
+    public:
+        void send(const std::string& bytes) { _input += bytes; }
+
+        int available() override { return (int)(_input.size() - _read); }
+        int read() override
+        {
+            return _read < _input.size() ? (uint8_t)_input[_read++] : -1;
+        }
+        int peek() override
+        {
+            return _read < _input.size() ? (uint8_t)_input[_read] : -1;
+        }
+        int availableForWrite() override { return 256; }
+
+        size_t write(uint8_t value) override
+        {
+            if (value == '\r') return 1;
+            if (value != '\n') {
+                _line += (char)value;
+                return 1;
+            }
+            _lines.push_back(_line);
+            _line.clear();
+            return 1;
+        }
+
+        // Removes and returns the oldest answer starting with prefix, or
+        // an empty string.
+        std::string take(const char* prefix)
+        {
+            size_t length = strlen(prefix);
+            for (size_t index = 0; index < _lines.size(); ++index) {
+                if (_lines[index].compare(0, length, prefix) != 0) continue;
+                std::string line = _lines[index];
+                _lines.erase(_lines.begin() + index);
+                return line;
+            }
+            return std::string();
+        }
+
+    private:
+        std::string _input;
+        size_t _read = 0;
+        std::string _line;
+        std::vector<std::string> _lines;
+};
+
+class ProtocolRig
+{
+    public:
+        ProtocolRig()
+            : _motors{
+                  { &_stepperA, LimitedStepper::MODULO, 0 },
+                  { &_stepperB, ModuloStepper::MODULO, 0 },
+                  { &_stepperC, LimitedStepper::MODULO, 1 },
+                  { &_stepperD, ModuloStepper::MODULO, 1 },
+              },
+              _protocol(serial, _motors, motorCount, "I: Moving Speaker protocol")
+        {
+            nativeResetIo();
+            timerPeriodCalls.clear();
+            _protocol.setTimerPeriodHandler(recordTimerPeriod);
+            _stepperA.Setup(2, 3, -8000, 8000);
+            _stepperB.Setup(4, 5, 0, 16000);
+            _stepperC.Setup(6, 7, -8000, 8000);
+            _stepperD.Setup(8, 9, 0, 16000);
+            _steppers[0] = &_stepperA;
+            _steppers[1] = &_stepperB;
+            _steppers[2] = &_stepperC;
+            _steppers[3] = &_stepperD;
+#if defined(STEPPER_STEP_SCHEDULING)
+            for (uint8_t index = 0; index < motorCount; ++index) _stepDue[index] = 0;
+#else
+            _bankGroup0.add(_stepperA);
+            _bankGroup0.add(_stepperB);
+            _bankGroup1.add(_stepperC);
+            _bankGroup1.add(_stepperD);
+#endif
+            tick();
+        }
+
+        // One pass of the main loop without a motor interrupt.
+        void process() { _protocol.process(); }
+
+        // One timer period: the motor interrupts, then the main loop.
+        void tick()
+        {
+            uint64_t end = _nowUs + motorTimerPeriodUs;
+#if defined(STEPPER_STEP_SCHEDULING)
+            for (uint8_t index = 0; index < motorCount; ++index) {
+                while (_stepDue[index] < end)
+                    _stepDue[index] += _steppers[index]->RunStepISR();
+            }
+#else
+            _bankGroup0.RunISR();
+            _bankGroup1.RunISR();
+#endif
+            _nowUs = end;
+            nativeAdvanceMicros(motorTimerPeriodUs);
+            _protocol.process();
+        }
+
+        bool anyRunning()
+        {
+            for (uint8_t index = 0; index < motorCount; ++index) {
+                if (state(index).running) return true;
+            }
+            return false;
+        }
+
+        // Runs until every motor has stopped; false after 60 s.
+        bool settle()
+        {
+            for (unsigned long ticks = 0; ticks < maxSettleTicks; ++ticks) {
+                if (!anyRunning()) return true;
+                tick();
+            }
+            return false;
+        }
+
+        StepperState state(uint8_t motor)
+        {
+            StepperState result;
+            _steppers[motor]->readState(result);
+            return result;
+        }
+
+        long timerPeriodUs(uint8_t motor)
+        {
+            return lround(_steppers[motor]->getTimerPeriod() * 1e6);
+        }
+
+        double positionDeg(uint8_t motor)
+        {
+            StepperState current = state(motor);
+            return current.position * current.degreesPerStep;
+        }
+
+        ProtocolStream serial;
+
+    private:
+        LimitedStepper _stepperA;
+        ModuloStepper _stepperB;
+        LimitedStepper _stepperC;
+        ModuloStepper _stepperD;
+        StepperCore* _steppers[motorCount];
+        MotorChannel _motors[motorCount];
+        MovingSpeakerProtocol _protocol;
+#if defined(STEPPER_STEP_SCHEDULING)
+        uint64_t _stepDue[motorCount];
+#else
+        StepperBank _bankGroup0;
+        StepperBank _bankGroup1;
+#endif
+        uint64_t _nowUs = 0;
+};
+
+// The wire bytes of a binary frame: COBS of payload and CRC, a delimiter.
+std::string binaryFrame(const std::vector<uint8_t>& payload)
+{
+    uint8_t frame[64];
+    uint16_t length = (uint16_t)payload.size();
+    memcpy(frame + 1, payload.data(), length);
+    uint16_t crc = crc16Ccitt(frame + 1, length);
+    frame[1 + length] = (uint8_t)crc;
+    frame[2 + length] = (uint8_t)(crc >> 8);
+    cobsEncodeInPlace(frame, length + 2);
+    return std::string((const char*)frame, length + 3) + std::string(1, '\0');
+}
+
+// An addressed setpoint for motor A: target in 0.01°, speed in 0.1°/s and
+// acceleration in 0.1°/s².
+std::vector<uint8_t> setpointA(int32_t target, uint16_t speed, uint16_t accel)
+{
+    return { BIN_ADDRESSED, 0, 1,
+             (uint8_t)target, (uint8_t)(target >> 8), (uint8_t)(target >> 16),
+             (uint8_t)(target >> 24), (uint8_t)speed, (uint8_t)(speed >> 8),
+             (uint8_t)accel, (uint8_t)(accel >> 8) };
+}
+
+unsigned long failures = 0;
+const char* currentCase = "";
+
+void expect(bool condition, const char* what, const std::string& detail = "")
+{
+    if (condition) return;
+    ++failures;
+    fprintf(stderr, "FAIL %s: %s%s%s\n", currentCase, what,
+            detail.empty() ? "" : ": ", detail.c_str());
+}
+
+bool near(double value, double expected)
+{
+    return fabs(value - expected) < 0.05;
+}
+
+// T right after a move command, before the interrupt has taken the plan,
+// already reports the motor running towards the new target.
+void stateRightAfterCommand()
+{
+    ProtocolRig rig;
+    rig.serial.send("@1,90,10,200\nT\n");
+    rig.process();
+    rig.process();
+
+    std::string frame = rig.serial.take("S: ");
+    expect(frame.compare(0, 17, "S: 1,90.00,10.00,") == 0, "S frame", frame);
+    expect(rig.settle(), "motors stop");
+    expect(near(rig.positionDeg(0), 90.0), "motor A on target");
+}
+
+// A timer period change refused because a motor of the group still has a
+// plan pending leaves the timer and every motor of the group as they were.
+void refusedTimerPeriod()
+{
+    ProtocolRig rig;
+    rig.serial.send("@1,0,10,200\nM0,32000,-90,90,960\n");
+    rig.process();
+    rig.process();
+
+    std::string error = rig.serial.take("E: ");
+    expect(error == "E: Invalid frame: motor running", "refused", error);
+    expect(timerPeriodCalls.empty(), "timer untouched");
+    expect(rig.timerPeriodUs(0) == stepPeriodUs && rig.timerPeriodUs(1) == stepPeriodUs,
+           "group 0 motors untouched");
+
+    rig.tick();
+    rig.serial.send("M0,32000,-90,90,960\n");
+    rig.tick();
+    std::string reply = rig.serial.take("M: ");
+    expect(!reply.empty(), "applied once stopped", rig.serial.take("E: "));
+    expect(timerPeriodCalls.size() == 1 && timerPeriodCalls[0] == 960,
+           "timer of group 0 set once");
+    expect(rig.timerPeriodUs(0) == 960 && rig.timerPeriodUs(1) == 960,
+           "group 0 motors on the new period");
+    expect(rig.timerPeriodUs(2) == stepPeriodUs, "group 1 untouched");
+}
+
+// With coalescing, two motion lines arriving together reach the motor as
+// one command: only the newest target is applied and one line is counted
+// as coalesced.
+void coalescedBacklog()
+{
+    ProtocolRig rig;
+    rig.serial.send("C1\n");
+    rig.process();
+    std::string reply = rig.serial.take("C: ");
+    expect(reply == "C: 1,0", "coalescing on", reply);
+
+    rig.serial.send("@1,30,10,200\n@1,60,10,200\n");
+    rig.process();
+    StepperState current = rig.state(0);
+    expect(near(current.targetPosition * current.degreesPerStep, 60.0),
+           "newest target applied");
+
+    rig.serial.send("C\n");
+    rig.process();
+    reply = rig.serial.take("C: ");
+    expect(reply == "C: 1,1", "one line coalesced", reply);
+    expect(rig.settle(), "motors stop");
+    expect(near(rig.positionDeg(0), 60.0), "motor A on the newest target");
+}
+
+// In binary mode, frames sent with a leading delimiter are taken as they
+// are; only the stop frame stops the motors.
+void binaryLeadingDelimiter()
+{
+    ProtocolRig rig;
+    rig.serial.send("B\n");
+    rig.process();
+    std::string reply = rig.serial.take("I: ");
+    expect(reply == "I: Binary mode", "binary mode", reply);
+
+    rig.serial.send(std::string(1, '\0') + binaryFrame(setpointA(9000, 100, 2000)));
+    for (int tick = 0; tick < 200; ++tick) rig.tick();
+    rig.serial.send(std::string(1, '\0') + binaryFrame({ BIN_STATE_REQUEST }));
+    for (int tick = 0; tick < 200; ++tick) rig.tick();
+    expect(rig.state(0).running, "still running after the empty frames");
+    expect(rig.settle(), "motors stop");
+    expect(near(rig.positionDeg(0), 90.0), "motor A on target");
+
+    rig.serial.send(binaryFrame(setpointA(0, 100, 2000)));
+    for (int tick = 0; tick < 200; ++tick) rig.tick();
+    rig.serial.send(binaryFrame({ BIN_EMERGENCY_STOP }));
+    expect(rig.settle(), "motors stop");
+    expect(rig.positionDeg(0) > 45.0, "stop frame brakes motor A",
+           std::to_string(rig.positionDeg(0)));
+}
+
+// A mask with a bit of a motor the target does not have is refused as a
+// whole, in ASCII and in binary, instead of moving the motors it does have.
+void maskBeyondMotors()
+{
+    ProtocolRig rig;
+    rig.serial.send("@17,90,10,200\nH17\n");
+    rig.process();
+    rig.process();
+    std::string error = rig.serial.take("E: ");
+    expect(error == "E: Invalid frame: invalid motor mask", "@17 refused", error);
+    error = rig.serial.take("E: ");
+    expect(error == "E: Invalid frame: invalid motor mask", "H17 refused", error);
+
+    rig.serial.send("B\n");
+    rig.process();
+    std::vector<uint8_t> setpoint = setpointA(9000, 100, 2000);
+    setpoint[2] = 0x11;
+    rig.serial.send(binaryFrame(setpoint));
+    rig.process();
+    expect(rig.settle(), "motors stop");
+    expect(near(rig.positionDeg(0), 0.0), "motor A not moved");
+}
+
+struct ProtocolCase
+{
+    const char* name;
+    void (*run)();
+};
+
+const ProtocolCase protocolCases[] = {
+    { "state right after a command", stateRightAfterCommand },
+    { "refused timer period", refusedTimerPeriod },
+    { "coalesced backlog", coalescedBacklog },
+    { "binary leading delimiter", binaryLeadingDelimiter },
+    { "mask beyond the motors", maskBeyondMotors },
+};
+}
+
+int main()
+{
+    unsigned long count = sizeof(protocolCases) / sizeof(protocolCases[0]);
+    for (unsigned long index = 0; index < count; ++index) {
+        currentCase = protocolCases[index].name;
+        unsigned long before = failures;
+        protocolCases[index].run();
+        printf("%-40s %s\n", currentCase, failures == before ? "ok" : "FAILED");
+    }
+
+    printf("%lu case(s), %lu failed check(s)\n", count, failures);
+    return failures == 0 ? 0 : 1;
+}
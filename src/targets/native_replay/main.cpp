@@ -0,0 +1,293 @@
+#include <Arduino.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "../../common/moving_speaker_protocol.h"
+#include "../../common/stepper_bank.h"
+
+// Headless replay of simulator scenarios against the firmware code.
+//
+// The scenario lines go through MovingSpeakerProtocol and StepperCore as
+// configured on esp32_4m, on a virtual clock advanced one 480 us timer
+// period at a time, so a scene plays in a fraction of its real duration.
+// The format is that of moving_speaker_sim.py: one command per line,
+// `wait <seconds>` between them, blank lines and `#` comments ignored. Any
+// protocol line is accepted, not only the 14-field setpoint.
+//
+// Every period one CSV row is written with the time and, per motor, the
+// position in degrees, the speed in degrees/s and the STEP pulses of the
+// period. The firmware's answers other than P frames go to stderr. After
+// the last line the replay continues until every motor has stopped.
+//
+// Usage: native_replay <scenario> [trace.csv]. The exit status is 1 when
+// the firmware answered with an E: frame or a motor did not stop.
+
+namespace {
+constexpr uint32_t motorTimerPeriodUs = 480;
+#if defined(STEPPER_STEP_SCHEDULING)
+constexpr uint32_t stepPeriodUs = 48;
+#else
+constexpr uint32_t stepPeriodUs = motorTimerPeriodUs;
+#endif
+constexpr unsigned long maxSettleTicks = 60000000UL / motorTimerPeriodUs;
+constexpr uint8_t motorCount = 4;
+
+typedef StepperCoreT<32000, stepPeriodUs, false> LimitedStepper;
+typedef StepperCoreT<16000, stepPeriodUs, true> ModuloStepper;
+
+// Host side of the serial link: the scenario is written into the input,
+// the firmware's frames are split into lines as they arrive.
+class ReplayStream : public Stream
+{
+    public:
+        void send(const std::string& line)
+        {
+            _input += line;
+            _input += '\n';
+        }
+
+        int available() override { return (int)(_input.size() - _read); }
+        int read() override
+        {
+            return _read < _input.size() ? (uint8_t)_input[_read++] : -1;
+        }
+        int peek() override
+        {
+            return _read < _input.size() ? (uint8_t)_input[_read] : -1;
+        }
+        int availableForWrite() override { return 256; }
+
+        size_t write(uint8_t value) override
+        {
+            if (value == '\r') return 1;
+            if (value != '\n') {
+                _line += (char)value;
+                return 1;
+            }
+            if (_line.compare(0, 3, "P: ") != 0)
+                fprintf(stderr, "[%.3f] %s\n", _time, _line.c_str());
+            if (_line.compare(0, 3, "E: ") == 0) ++_errors;
+            _line.clear();
+            return 1;
+        }
+
+        void setTime(double seconds) { _time = seconds; }
+        unsigned long errors() const { return _errors; }
+
+    private:
+        std::string _input;
+        size_t _read = 0;
+        std::string _line;
+        double _time = 0.0;
+        unsigned long _errors = 0;
+};
+
+struct ScenarioStep
+{
+    bool wait;
+    double seconds;
+    std::string line;
+};
+
+LimitedStepper stepperA;
+ModuloStepper stepperB;
+LimitedStepper stepperC;
+ModuloStepper stepperD;
+StepperCore* const steppers[motorCount] = {
+    &stepperA, &stepperB, &stepperC, &stepperD,
+};
+const char* const motorNames[motorCount] = { "A", "B", "C", "D" };
+
+MotorChannel motors[] = {
+    { &stepperA, LimitedStepper::MODULO, 0 },
+    { &stepperB, ModuloStepper::MODULO, 0 },
+    { &stepperC, LimitedStepper::MODULO, 1 },
+    { &stepperD, ModuloStepper::MODULO, 1 },
+};
+
+ReplayStream serial;
+MovingSpeakerProtocol protocol(serial, motors, motorCount,
+                               "I: Moving Speaker replay");
+
+#if defined(STEPPER_STEP_SCHEDULING)
+// Each motor steps at its own deadline, as with the ESP32 alarms.
+uint64_t stepDue[motorCount];
+#else
+StepperBank bankGroup0;
+StepperBank bankGroup1;
+#endif
+
+uint64_t nowUs = 0;
+unsigned long long stepCounts[motorCount];
+FILE* trace = stdout;
+
+std::string trim(const std::string& text)
+{
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) return std::string();
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+}
+
+// Returns false with a message on stderr for an unreadable file or a
+// malformed wait.
+bool parseScenario(const char* path, ScenarioStep* steps, size_t capacity,
+                   size_t& count)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+
+    char text[512];
+    unsigned long lineNumber = 0;
+    count = 0;
+    while (fgets(text, sizeof(text), file)) {
+        ++lineNumber;
+        std::string line = trim(text);
+        if (line.empty() || line[0] == '#') continue;
+        if (count == capacity) {
+            fprintf(stderr, "%s:%lu: too many steps\n", path, lineNumber);
+            fclose(file);
+            return false;
+        }
+
+        ScenarioStep& step = steps[count++];
+        step.wait = line.compare(0, 5, "wait ") == 0 ||
+                    line.compare(0, 5, "WAIT ") == 0;
+        step.seconds = 0.0;
+        step.line = line;
+        if (!step.wait) continue;
+
+        char* end = nullptr;
+        step.seconds = strtod(line.c_str() + 5, &end);
+        if (end == line.c_str() + 5 || *end != '\0' || step.seconds < 0.0) {
+            fprintf(stderr, "%s:%lu: wait expects seconds\n", path, lineNumber);
+            fclose(file);
+            return false;
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+bool anyRunning()
+{
+    for (uint8_t index = 0; index < motorCount; ++index) {
+        StepperState state;
+        steppers[index]->readState(state);
+        if (state.running) return true;
+    }
+    return false;
+}
+
+void writeHeader()
+{
+    fprintf(trace, "time_s");
+    for (uint8_t index = 0; index < motorCount; ++index)
+        fprintf(trace, ",%s_position_deg,%s_speed_deg_s,%s_steps",
+                motorNames[index], motorNames[index], motorNames[index]);
+    fprintf(trace, "\n");
+}
+
+void writeRow()
+{
+    fprintf(trace, "%.6f", nowUs * 1e-6);
+    for (uint8_t index = 0; index < motorCount; ++index) {
+        StepperState state;
+        steppers[index]->readState(state);
+        unsigned long long steps = nativeRisingEdges(steppers[index]->getStepPin());
+        fprintf(trace, ",%.3f,%.3f,%llu", state.position * state.degreesPerStep,
+                state.speed * state.degreesPerStep, steps - stepCounts[index]);
+        stepCounts[index] = steps;
+    }
+    fprintf(trace, "\n");
+}
+
+// One timer period of the target: the motor interrupts, one pass of the
+// main loop and a trace row.
+void tick()
+{
+    uint64_t end = nowUs + motorTimerPeriodUs;
+#if defined(STEPPER_STEP_SCHEDULING)
+    for (uint8_t index = 0; index < motorCount; ++index) {
+        while (stepDue[index] < end)
+            stepDue[index] += steppers[index]->RunStepISR();
+    }
+#else
+    bankGroup0.RunISR();
+    bankGroup1.RunISR();
+#endif
+    nowUs = end;
+    nativeAdvanceMicros(motorTimerPeriodUs);
+
+    serial.setTime(nowUs * 1e-6);
+    protocol.process();
+    writeRow();
+}
+
+void setupMotors()
+{
+    stepperA.Setup(2, 3, -8000, 8000);
+    stepperB.Setup(4, 5, 0, 16000);
+    stepperC.Setup(6, 7, -8000, 8000);
+    stepperD.Setup(8, 9, 0, 16000);
+#if !defined(STEPPER_STEP_SCHEDULING)
+    bankGroup0.add(stepperA);
+    bankGroup0.add(stepperB);
+    bankGroup1.add(stepperC);
+    bankGroup1.add(stepperD);
+#endif
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "usage: %s <scenario> [trace.csv]\n", argv[0]);
+        return 2;
+    }
+
+    static ScenarioStep steps[4096];
+    size_t stepCount = 0;
+    if (!parseScenario(argv[1], steps, sizeof(steps) / sizeof(steps[0]), stepCount))
+        return 2;
+
+    if (argc == 3) {
+        trace = fopen(argv[2], "w");
+        if (!trace) {
+            fprintf(stderr, "cannot create %s\n", argv[2]);
+            return 2;
+        }
+    }
+
+    nativeResetIo();
+    setupMotors();
+    writeHeader();
+
+    for (size_t index = 0; index < stepCount; ++index) {
+        const ScenarioStep& step = steps[index];
+        if (!step.wait) {
+            serial.send(step.line);
+            tick();
+            continue;
+        }
+
+        uint64_t until = nowUs + (uint64_t)(step.seconds * 1e6 + 0.5);
+        while (nowUs < until) tick();
+    }
+
+    unsigned long settle = 0;
+    while (anyRunning() && settle < maxSettleTicks) {
+        tick();
+        ++settle;
+    }
+    bool stopped = !anyRunning();
+    if (!stopped) fprintf(stderr, "motors still running after 60 s\n");
+
+    if (trace != stdout) fclose(trace);
+    fprintf(stderr, "replayed %.3f s of virtual time, %lu error frame(s)\n",
+            nowUs * 1e-6, serial.errors());
+    return serial.errors() == 0 && stopped ? 0 : 1;
+}
@@ -0,0 +1,725 @@
+#include <Arduino.h>
+#include <atomic>
+#include <mutex>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../../common/stepper_core.h"
+
+// Randomized stress test of the tick kernel.
+//
+// Each case is a random sequence of applyCommandDegrees() calls with random
+// waits between them, run through RunISR() on a virtual 480 us clock until
+// the motor has stopped. Half of the cases set a random jerk limit first.
+// After every period the motion is checked:
+//
+//   vmax     the speed never rises above _vmax
+//   accel    the speed changes by at most the acceleration of the plan
+//            in use per period, except for the stop on the last step of
+//            a move
+//   target   no step goes past _targetPos, and outside of a reversal every
+//            step goes towards it
+//   limits   a limited motor stays inside its travel
+//   reversal a reversal ends within its braking time
+//   settle   the motor stops on the last commanded target in time
+//
+// The cases are spread over one thread per host core, each with its own
+// StepperCore. Case n of a seed is the same whatever thread runs it. The
+// first violation is shrunk to a minimal command sequence, printed in the
+// case format below; `--replay` runs such a file again with a trace.
+//
+//   motor limited|modulo
+//   jerk <jerk_deg_s3>
+//   command <target_deg>,<speed_deg_s>,<accel_deg_s2>[,<mode>]
+//   wait <periods>
+//
+// The cases of earlier violations in regressionCases run first, on every
+// run.
+//
+// Usage: native_stress [cases] [seed] [threads]
+//        native_stress --replay <case>
+// The exit status is 1 when a violation was found.
+
+#if defined(STEPPER_STEP_SCHEDULING)
+#error "native_stress checks the tick kernel, build it without STEPPER_STEP_SCHEDULING"
+#endif
+
+namespace {
+constexpr unsigned long stressTimerPeriodUs = 480;
+constexpr double stressTimerPeriod = stressTimerPeriodUs * 1e-6;
+constexpr uint8_t stressStepPin = 3;
+constexpr uint8_t stressDirPin = 2;
+constexpr uint8_t maxCommands = 12;
+constexpr unsigned long maxWaitTicks = 20000;
+// Relative slack for rounding in the speed comparisons.
+constexpr double speedTolerance = 1e-6;
+
+struct StressMotor
+{
+    const char* name;
+    long stepsPerRev;
+    long minPos;
+    long maxPos;
+    bool modulo;
+};
+
+// Motors A and B of esp32_4m.
+const StressMotor stressMotors[] = {
+    { "limited", 32000, -8000, 8000, false },
+    { "modulo", 16000, 0, 16000, true },
+};
+constexpr uint8_t stressMotorCount = sizeof(stressMotors) / sizeof(stressMotors[0]);
+
+const char* const modeNames[] = { "shortest", "cw", "ccw" };
+
+struct StressCommand
+{
+    double target;
+    double speed;
+    double acceleration;
+    RotaryMode mode;
+    unsigned long waitTicks;
+};
+
+struct StressCase
+{
+    uint8_t motor;
+    // Jerk limit in degrees/s^3, 0 for the trapezoid.
+    double jerk;
+    std::vector<StressCommand> commands;
+};
+
+struct Violation
+{
+    bool found;
+    const char* rule;
+    unsigned long tick;
+    std::string detail;
+};
+
+class StressStepper : public StepperCore
+{
+    public:
+        long position() const { return _position; }
+        long target() const { return _targetPos; }
+        long plannedTarget() const { return _plannedTarget; }
+        bool reversing() const { return _reversing; }
+        // Also true for a command the interrupt has not picked up yet.
+        bool busy() { return isRunning() || _planPending; }
+        double speed() { return speedStepsPerSec(_curSpeed); }
+        double maxSpeed() const { return _vmax; }
+        double acceleration() const { return _accel; }
+        double jerk() const { return _jerk; }
+        // Acceleration of the plan the interrupt follows, which may brake
+        // harder than _accel for one leg after the acceleration was lowered.
+        double planAcceleration()
+        {
+            return speedStepsPerSec(_plans[_activePlan].acceleration) / _timerPeriod;
+        }
+        // Smallest non-zero speed of the kernel in steps/s.
+#if defined(STEPPER_FIXED_POINT)
+        double speedQuantum() { return speedStepsPerSec(1); }
+#else
+        double speedQuantum() { return 0.0; }
+#endif
+};
+
+// splitmix64, so that a seed gives the same cases on every host.
+class StressRandom
+{
+    public:
+        explicit StressRandom(uint64_t seed) : _state(seed) {}
+
+        uint64_t next()
+        {
+            uint64_t value = (_state += 0x9E3779B97F4A7C15ULL);
+            value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ULL;
+            value = (value ^ (value >> 27)) * 0x94D049BB133111EBULL;
+            return value ^ (value >> 31);
+        }
+
+        double uniform(double low, double high)
+        {
+            return low + (high - low) * ((next() >> 11) * (1.0 / 9007199254740992.0));
+        }
+
+        unsigned long below(unsigned long count)
+        {
+            return (unsigned long)(next() % count);
+        }
+
+    private:
+        uint64_t _state;
+};
+
+// Commands mostly inside the limits and the speed and acceleration
+// bounds, with some outside to exercise the clamping.
+StressCase randomCase(uint64_t seed, uint64_t index)
+{
+    StressRandom random(seed ^ (index * 0xD1B54A32D192ED03ULL));
+    random.next();
+
+    StressCase stress;
+    stress.motor = (uint8_t)random.below(stressMotorCount);
+    const StressMotor& motor = stressMotors[stress.motor];
+    double degreesPerStep = 360.0 / motor.stepsPerRev;
+    double low = motor.minPos * degreesPerStep;
+    double high = motor.maxPos * degreesPerStep;
+    double span = high - low;
+
+    unsigned long count = 1 + random.below(maxCommands);
+    for (unsigned long index = 0; index < count; ++index) {
+        StressCommand command;
+        command.target = random.uniform(low - 0.1 * span, high + 0.1 * span);
+        command.speed = random.uniform(1.0, 60.0);
+        command.acceleration = random.uniform(2.0, 140.0);
+        command.mode = motor.modulo ? (RotaryMode)random.below(3) : ROT_SHORTEST;
+
+        // Back-to-back commands, commands within a few periods of each
+        // other and commands mid-move.
+        switch (random.below(4)) {
+            case 0: command.waitTicks = 0; break;
+            case 1: command.waitTicks = random.below(8); break;
+            default: command.waitTicks = random.below(maxWaitTicks); break;
+        }
+        stress.commands.push_back(command);
+    }
+
+    // Drawn last so that the commands of a case do not depend on it.
+    stress.jerk = random.below(2) ? random.uniform(20.0, 5000.0) : 0.0;
+    return stress;
+}
+
+class StressRun
+{
+    public:
+        StressRun(const StressCase& stress, bool trace)
+            : _stress(stress), _motor(stressMotors[stress.motor]), _trace(trace)
+        {
+        }
+
+        Violation run()
+        {
+            nativeResetIo();
+            _stepper.Setup(stressStepPin, stressDirPin, stressTimerPeriod,
+                           _motor.stepsPerRev, _motor.minPos, _motor.maxPos);
+            _stepper.setJerkDegrees(_stress.jerk);
+            _violation = Violation{ false, "", 0, std::string() };
+            _tick = 0;
+            _reversalBudget = 0;
+
+            for (size_t index = 0; index < _stress.commands.size(); ++index) {
+                const StressCommand& command = _stress.commands[index];
+                if (_motor.modulo) _stepper.renormalizePosition();
+                _stepper.applyCommandDegrees(command.target, command.speed,
+                                             command.acceleration, command.mode,
+                                             _motor.modulo);
+                if (_trace)
+                    printf("%lu: command %zu -> %ld steps, vmax %.3f, accel %.3f\n",
+                           _tick, index, _stepper.plannedTarget(),
+                           _stepper.maxSpeed(), _stepper.acceleration());
+
+                for (unsigned long wait = 0; wait < command.waitTicks; ++wait) {
+                    if (!tick()) return _violation;
+                }
+            }
+
+            settle();
+            return _violation;
+        }
+
+    private:
+        void fail(const char* rule, const char* format, ...)
+            __attribute__((format(printf, 3, 4)))
+        {
+            char text[200];
+            va_list args;
+            va_start(args, format);
+            vsnprintf(text, sizeof(text), format, args);
+            va_end(args);
+
+            _violation.found = true;
+            _violation.rule = rule;
+            _violation.tick = _tick;
+            _violation.detail = text;
+        }
+
+        // Runs the motor until it stops on the planned target, within the
+        // time the move needs from its current state with a wide margin.
+        void settle()
+        {
+            double speed = fabs(_stepper.speed());
+            double vmax = _stepper.maxSpeed();
+            double accel = _stepper.acceleration();
+            // A motor moving away first brakes past its position.
+            double distance = fabs((double)_stepper.plannedTarget() - _stepper.position()) +
+                              speed * speed / (2.0 * accel);
+            double seconds = 2.0 * (distance / vmax + 2.0 * (vmax + speed) / accel) + 1.0;
+            // Each of the acceleration ramps of an S-curve adds a / j.
+            if (_stepper.jerk() > 0.0) seconds += 8.0 * accel / _stepper.jerk();
+            unsigned long limit = (unsigned long)(seconds / stressTimerPeriod);
+
+            for (unsigned long index = 0; index < limit && _stepper.busy(); ++index) {
+                if (!tick()) return;
+            }
+            if (_stepper.busy()) {
+                fail("settle", "still running after %.1f s at %ld, speed %.3f",
+                     seconds, _stepper.position(), _stepper.speed());
+                return;
+            }
+            if (_stepper.position() != _stepper.plannedTarget())
+                fail("settle", "stopped at %ld instead of %ld", _stepper.position(),
+                     _stepper.plannedTarget());
+        }
+
+        bool tick()
+        {
+            long position = _stepper.position();
+            double speed = _stepper.speed();
+            bool reversing = _stepper.reversing();
+
+            _stepper.RunISR();
+            nativeAdvanceMicros(stressTimerPeriodUs);
+            ++_tick;
+
+            check(position, speed, reversing);
+            if (_trace && !_violation.found)
+                printf("%lu: position %ld, speed %.3f, target %ld%s\n", _tick,
+                       _stepper.position(), _stepper.speed(), _stepper.target(),
+                       _stepper.reversing() ? ", reversing" : "");
+            return !_violation.found;
+        }
+
+        void check(long before, double speedBefore, bool reversingBefore)
+        {
+            long after = _stepper.position();
+            double speedAfter = _stepper.speed();
+            double vmax = _stepper.maxSpeed();
+            double accel = _stepper.planAcceleration();
+            double quantum = 2.0 * _stepper.speedQuantum();
+            double magnitudeBefore = fabs(speedBefore);
+            double magnitudeAfter = fabs(speedAfter);
+            long target = _stepper.target();
+
+            // Above vmax, after a command that lowered it, only braking.
+            double ceiling = vmax > magnitudeBefore ? vmax : magnitudeBefore;
+            if (magnitudeAfter > ceiling * (1.0 + speedTolerance) + quantum) {
+                fail("vmax", "speed %.3f > vmax %.3f", speedAfter, vmax);
+                return;
+            }
+
+            // The stop on the last step of a move comes from at most the
+            // braking curve two steps before the target, sqrt(4a): the step
+            // accumulator may hold almost one more step than the distance.
+            double change = fabs(speedAfter - speedBefore);
+            double step = accel * stressTimerPeriod;
+            bool stopNearTarget = speedAfter == 0.0 && labs(target - after) <= 1 &&
+                                  magnitudeBefore <= sqrt(4.0 * accel) + step + quantum;
+            if (!stopNearTarget && change > step * (1.0 + speedTolerance) + quantum) {
+                fail("accel", "speed %.3f -> %.3f, limit %.3f per period",
+                     speedBefore, speedAfter, step);
+                return;
+            }
+
+            if (after != before) {
+                long moved = after - before;
+                if (labs(moved) != 1) {
+                    fail("target", "jumped from %ld to %ld", before, after);
+                    return;
+                }
+                if ((target - before) * (target - after) < 0 ||
+                    (before == target)) {
+                    fail("target", "stepped from %ld to %ld past target %ld",
+                         before, after, target);
+                    return;
+                }
+                if (!reversingBefore && !_stepper.reversing() &&
+                    (moved > 0) != (target > before)) {
+                    fail("target", "stepped from %ld to %ld away from target %ld",
+                         before, after, target);
+                    return;
+                }
+            }
+
+            if (!_motor.modulo && (after < _motor.minPos || after > _motor.maxPos)) {
+                fail("limits", "position %ld outside [%ld, %ld]", after,
+                     _motor.minPos, _motor.maxPos);
+                return;
+            }
+
+            // A command during the reversal may change its deceleration.
+            // With a jerk limit the deceleration first ramps up from as
+            // much acceleration, and back down at the end.
+            if (_stepper.reversing()) {
+                if (!reversingBefore || step != _reversalStep) {
+                    double rampTicks = 0.0;
+                    if (_stepper.jerk() > 0.0)
+                        rampTicks = 3.0 * accel / (_stepper.jerk() * stressTimerPeriod);
+                    _reversalBudget =
+                        (unsigned long)(magnitudeBefore / step + rampTicks) + 3;
+                    _reversalStep = step;
+                }
+                if (_reversalBudget == 0) {
+                    fail("reversal", "still reversing at speed %.3f", speedAfter);
+                    return;
+                }
+                --_reversalBudget;
+            }
+        }
+
+        const StressCase& _stress;
+        const StressMotor& _motor;
+        bool _trace;
+        StressStepper _stepper;
+        Violation _violation;
+        unsigned long _tick = 0;
+        unsigned long _reversalBudget = 0;
+        double _reversalStep = 0.0;
+};
+
+Violation runCase(const StressCase& stress, bool trace = false)
+{
+    StressRun run(stress, trace);
+    return run.run();
+}
+
+// A violation of another rule is a different bug, so candidates must keep
+// the rule of the original failure.
+bool stillFails(const StressCase& stress, const char* rule)
+{
+    Violation violation = runCase(stress);
+    return violation.found && strcmp(violation.rule, rule) == 0;
+}
+
+bool tryShrink(StressCase& stress, const StressCase& candidate, const char* rule)
+{
+    if (!stillFails(candidate, rule)) return false;
+    stress = candidate;
+    return true;
+}
+
+// Greedy shrinking until no single change keeps the failure: drop
+// commands, shorten the waits, then round the values.
+StressCase shrink(StressCase stress, const char* rule)
+{
+    bool progress = true;
+    while (progress) {
+        progress = false;
+
+        for (size_t index = 0; index < stress.commands.size() && stress.commands.size() > 1;) {
+            StressCase candidate = stress;
+            candidate.commands.erase(candidate.commands.begin() + index);
+            if (tryShrink(stress, candidate, rule)) progress = true;
+            else ++index;
+        }
+
+        for (size_t index = 0; index < stress.commands.size(); ++index) {
+            while (stress.commands[index].waitTicks > 0) {
+                StressCase candidate = stress;
+                candidate.commands[index].waitTicks = 0;
+                if (tryShrink(stress, candidate, rule)) {
+                    progress = true;
+                    break;
+                }
+                candidate.commands[index].waitTicks = stress.commands[index].waitTicks / 2;
+                if (!tryShrink(stress, candidate, rule)) break;
+                progress = true;
+            }
+        }
+
+        if (stress.jerk != round(stress.jerk)) {
+            StressCase candidate = stress;
+            candidate.jerk = round(stress.jerk);
+            if (tryShrink(stress, candidate, rule)) progress = true;
+        }
+        if (stress.jerk != 0.0) {
+            StressCase candidate = stress;
+            candidate.jerk = 0.0;
+            if (tryShrink(stress, candidate, rule)) progress = true;
+        }
+
+        for (size_t index = 0; index < stress.commands.size(); ++index) {
+            double* values[] = {
+                &stress.commands[index].target,
+                &stress.commands[index].speed,
+                &stress.commands[index].acceleration,
+            };
+            for (uint8_t field = 0; field < 3; ++field) {
+                double value = *values[field];
+                double rounded = round(value);
+                if (rounded == value) continue;
+                StressCase candidate = stress;
+                double* slot[] = {
+                    &candidate.commands[index].target,
+                    &candidate.commands[index].speed,
+                    &candidate.commands[index].acceleration,
+                };
+                *slot[field] = rounded;
+                if (tryShrink(stress, candidate, rule)) progress = true;
+            }
+            if (stress.commands[index].mode != ROT_SHORTEST) {
+                StressCase candidate = stress;
+                candidate.commands[index].mode = ROT_SHORTEST;
+                if (tryShrink(stress, candidate, rule)) progress = true;
+            }
+        }
+    }
+    return stress;
+}
+
+void printCase(FILE* file, const StressCase& stress)
+{
+    fprintf(file, "motor %s\n", stressMotors[stress.motor].name);
+    if (stress.jerk > 0.0) fprintf(file, "jerk %.17g\n", stress.jerk);
+    for (const StressCommand& command : stress.commands) {
+        fprintf(file, "command %.17g,%.17g,%.17g,%s\n", command.target,
+                command.speed, command.acceleration, modeNames[command.mode]);
+        if (command.waitTicks > 0) fprintf(file, "wait %lu\n", command.waitTicks);
+    }
+}
+
+std::string trim(const std::string& text)
+{
+    size_t begin = text.find_first_not_of(" \t\r\n");
+    if (begin == std::string::npos) return std::string();
+    size_t end = text.find_last_not_of(" \t\r\n");
+    return text.substr(begin, end - begin + 1);
+}
+
+// A wait applies to the command before it; a wait before the first
+// command is an error. name is the file or case shown in the messages.
+bool parseCaseText(const std::string& text, const char* name, StressCase& stress)
+{
+    stress.motor = 0;
+    stress.jerk = 0.0;
+    stress.commands.clear();
+    unsigned long lineNumber = 0;
+    bool valid = true;
+    size_t begin = 0;
+    while (valid && begin < text.size()) {
+        size_t end = text.find('\n', begin);
+        if (end == std::string::npos) end = text.size();
+        std::string line = trim(text.substr(begin, end - begin));
+        begin = end + 1;
+        ++lineNumber;
+        if (line.empty() || line[0] == '#') continue;
+
+        if (line.compare(0, 6, "motor ") == 0) {
+            std::string motor = trim(line.substr(6));
+            valid = false;
+            for (uint8_t index = 0; index < stressMotorCount; ++index) {
+                if (motor == stressMotors[index].name) {
+                    stress.motor = index;
+                    valid = true;
+                }
+            }
+        } else if (line.compare(0, 5, "jerk ") == 0) {
+            char* end = nullptr;
+            stress.jerk = strtod(line.c_str() + 5, &end);
+            valid = end != line.c_str() + 5 && *end == '\0' && stress.jerk >= 0.0;
+        } else if (line.compare(0, 8, "command ") == 0) {
+            StressCommand command = { 0.0, 0.0, 0.0, ROT_SHORTEST, 0 };
+            char mode[16] = "shortest";
+            int fields = sscanf(line.c_str() + 8, "%lf,%lf,%lf,%15s", &command.target,
+                                &command.speed, &command.acceleration, mode);
+            valid = fields >= 3;
+            if (valid && fields == 4) {
+                valid = false;
+                for (uint8_t index = 0; index < 3; ++index) {
+                    if (strcmp(mode, modeNames[index]) == 0) {
+                        command.mode = (RotaryMode)index;
+                        valid = true;
+                    }
+                }
+            }
+            if (valid) stress.commands.push_back(command);
+        } else if (line.compare(0, 5, "wait ") == 0) {
+            char* end = nullptr;
+            unsigned long ticks = strtoul(line.c_str() + 5, &end, 10);
+            valid = !stress.commands.empty() && end != line.c_str() + 5 && *end == '\0';
+            if (valid) stress.commands.back().waitTicks += ticks;
+        } else {
+            valid = false;
+        }
+    }
+
+    if (!valid) fprintf(stderr, "%s:%lu: invalid line\n", name, lineNumber);
+    else if (stress.commands.empty()) fprintf(stderr, "%s: no command\n", name);
+    return valid && !stress.commands.empty();
+}
+
+bool parseCase(const char* path, StressCase& stress)
+{
+    FILE* file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "cannot open %s\n", path);
+        return false;
+    }
+
+    std::string text;
+    char buffer[256];
+    size_t length;
+    while ((length = fread(buffer, 1, sizeof(buffer), file)) > 0)
+        text.append(buffer, length);
+    fclose(file);
+    return parseCaseText(text, path, stress);
+}
+
+void printViolation(const Violation& violation)
+{
+    printf("violation: %s at period %lu: %s\n", violation.rule, violation.tick,
+           violation.detail.c_str());
+}
+
+int replay(const char* path)
+{
+    StressCase stress;
+    if (!parseCase(path, stress)) return 2;
+
+    Violation violation = runCase(stress, true);
+    if (!violation.found) {
+        printf("no violation\n");
+        return 0;
+    }
+    printViolation(violation);
+    return 1;
+}
+
+// Violations found by earlier runs, checked on every run before the
+// random cases.
+struct RegressionCase
+{
+    const char* name;
+    const char* text;
+};
+
+const RegressionCase regressionCases[] = {
+    // An S-curve that braked too late, seed 7 case 179529: it crawled onto
+    // the target and stopped from 73.7 steps/s on the last step.
+    { "late jerk braking",
+      "motor modulo\n"
+      "jerk 3388\n"
+      "command 147,47,118\n"
+      "wait 6\n"
+      "command 148,12,8.8107\n"
+      "wait 4\n"
+      "command 105.075,51,6.918,ccw\n"
+      "wait 16966\n"
+      "command -34,9,119\n"
+      "wait 6\n"
+      "command 91,40.252,110.558,cw\n"
+      "wait 10972\n"
+      "command 17.885,45,29.916\n" },
+};
+
+// Returns false after printing the first regression case that fails.
+bool runRegressionCases()
+{
+    for (const RegressionCase& regression : regressionCases) {
+        StressCase stress;
+        if (!parseCaseText(regression.text, regression.name, stress)) return false;
+
+        Violation violation = runCase(stress);
+        if (!violation.found) continue;
+        printf("regression case \"%s\" failed\n", regression.name);
+        printViolation(violation);
+        printf("--- case\n");
+        printCase(stdout, stress);
+        return false;
+    }
+    return true;
+}
+
+struct StressShared
+{
+    uint64_t seed;
+    uint64_t cases;
+    std::atomic<uint64_t> nextCase{ 0 };
+    std::atomic<uint64_t> doneCases{ 0 };
+    std::atomic<bool> failed{ false };
+    std::mutex failureLock;
+    uint64_t failureIndex = 0;
+    StressCase failure;
+    Violation violation;
+};
+
+// Takes case numbers until all are done or a case fails. Of several
+// failures the lowest case number is kept, so the report does not depend
+// on the thread timing.
+void worker(StressShared& shared)
+{
+    while (!shared.failed.load(std::memory_order_relaxed)) {
+        uint64_t index = shared.nextCase.fetch_add(1);
+        if (index >= shared.cases) return;
+
+        StressCase stress = randomCase(shared.seed, index);
+        Violation violation = runCase(stress);
+        shared.doneCases.fetch_add(1, std::memory_order_relaxed);
+        if (!violation.found) continue;
+
+        std::lock_guard<std::mutex> lock(shared.failureLock);
+        if (!shared.failed || index < shared.failureIndex) {
+            shared.failureIndex = index;
+            shared.failure = stress;
+            shared.violation = violation;
+        }
+        shared.failed = true;
+    }
+}
+}
+
+int main(int argc, char** argv)
+{
+    if (argc == 3 && strcmp(argv[1], "--replay") == 0) return replay(argv[2]);
+    if (argc > 4 || (argc > 1 && argv[1][0] == '-')) {
+        fprintf(stderr, "usage: %s [cases] [seed] [threads]\n"
+                        "       %s --replay <case>\n", argv[0], argv[0]);
+        return 2;
+    }
+
+    StressShared shared;
+    shared.cases = argc > 1 ? strtoull(argv[1], nullptr, 10) : 20000;
+    shared.seed = argc > 2 ? strtoull(argv[2], nullptr, 0) : 1;
+    unsigned long threads = argc > 3 ? strtoul(argv[3], nullptr, 10)
+                                     : std::thread::hardware_concurrency();
+    if (threads == 0) threads = 1;
+
+    printf("StepperCore::RunISR() stress: %llu cases, seed %llu, %lu threads%s\n",
+           (unsigned long long)shared.cases, (unsigned long long)shared.seed,
+           threads,
+#if defined(STEPPER_FIXED_POINT)
+           ", fixed point"
+#else
+           ""
+#endif
+    );
+    fflush(stdout);
+
+    if (!runRegressionCases()) return 1;
+
+    std::vector<std::thread> pool;
+    for (unsigned long index = 0; index < threads; ++index)
+        pool.emplace_back(worker, std::ref(shared));
+    for (std::thread& thread : pool) thread.join();
+
+    if (!shared.failed) {
+        printf("passed: %llu cases\n", (unsigned long long)shared.doneCases.load());
+        return 0;
+    }
+
+    printf("case %llu of seed %llu failed after %llu cases\n",
+           (unsigned long long)shared.failureIndex, (unsigned long long)shared.seed,
+           (unsigned long long)shared.doneCases.load());
+    printViolation(shared.violation);
+
+    StressCase minimal = shrink(shared.failure, shared.violation.rule);
+    printf("shrunk from %zu to %zu command(s):\n", shared.failure.commands.size(),
+           minimal.commands.size());
+    printViolation(runCase(minimal));
+    printf("--- replay with %s --replay <file>\n", argv[0]);
+    printCase(stdout, minimal);
+    return 1;
+}